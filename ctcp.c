@@ -12,9 +12,16 @@
  *****************************************************************************/
 
 #include "ctcp.h"
+#include "ctcp_codel.h"
 #include "ctcp_linked_list.h"
+#include "ctcp_mux.h"
+#include "ctcp_prof.h"
+#include "ctcp_ratelimit.h"
+#include "ctcp_stats.h"
 #include "ctcp_sys.h"
+#include "ctcp_trace.h"
 #include "ctcp_utils.h"
+#include "ctcp_wheel.h"
 
 /*
   * Flags for types of segment
@@ -34,14 +41,16 @@ typedef enum Segment_type
 /*
   * Flags for type of connection teardown
   * No CLOSE: normal operation
-  * ACTIVE CLOSE: client active close
-  * PASSIVE CLOSE: server passive close
+  * ACTIVE CLOSE: our input ended and our FIN is queued, the other host may still send
+  * PASSIVE CLOSE: the other host's FIN is received, we send until our input ends
+  * CLOSING: both FINs sent, waiting for ours to be acknowledged
 */
 typedef enum Teardown_state
 {
   NO_CLOSE,
   ACTIVE_CLOSE,
-  PASSIVE_CLOSE
+  PASSIVE_CLOSE,
+  CLOSING
 }Teardown_state;
 
 /*
@@ -60,6 +69,7 @@ typedef struct ACK_state
 
 /*
   * Store the information of the connection state
+  * peer_window: window last advertised by the other host
 */
 typedef struct Conn_state
 {
@@ -69,6 +79,7 @@ typedef struct Conn_state
   uint32_t last_ackno;
   uint16_t send_window;
   uint16_t send_window_used;
+  uint16_t peer_window;
   uint16_t rcv_window;
   uint16_t rcv_window_used;
 }Conn_state;
@@ -76,12 +87,18 @@ typedef struct Conn_state
 /*
   * Store the information of the transmit data
   * buffer size: size of the tx buffer
+  * flags: FIN (+ ACK) if the FIN is carried on this segment
+  * queued_at: time the data was read, in milliseconds, only kept for the queue delay control
+  * shared: input broadcast to every connection, held instead of copying it into tx buffer, NULL if none
   * tx buffer: flexible array member
 */
 typedef struct TX_state
 {
   uint32_t segment_next_seqno;
   int buffer_size;
+  uint32_t flags;
+  long queued_at;
+  shared_buf_t *shared;
   char tx_buffer[];
 }TX_state;
 
@@ -98,6 +115,111 @@ typedef struct RX_state
   char rx_buffer[];
 }RX_state;
 
+/*
+  * Store the round-trip time estimation of the connection (RFC 6298)
+  * srtt: smoothed round-trip time in microseconds, 0 if no sample yet
+  * rttvar: round-trip time variation in microseconds
+  * rtt_seqno: the segment being timed is acknowledged once ackno reaches this
+  * rtt_start: time the timed segment was sent
+  * rtt_pending: flag if a segment is being timed
+  * highest_seqno: highest sequence number ever sent, used to avoid timing retransmissions
+*/
+typedef struct RTT_state
+{
+  long srtt;
+  long rttvar;
+  uint32_t rtt_seqno;
+  long rtt_start;
+  bool rtt_pending;
+  uint32_t highest_seqno;
+}RTT_state;
+
+/*
+  * Store the congestion control state of the connection (RFC 5681)
+  * cwnd: congestion window in bytes, at most min(cwnd, send_window) bytes are in flight
+  * ssthresh: slow start threshold in bytes, slow start while cwnd is below it
+*/
+typedef struct Congestion_state
+{
+  uint32_t cwnd;
+  uint32_t ssthresh;
+}Congestion_state;
+
+/*
+  * Store the counters exported as statistics
+  * bytes_acked: total bytes acknowledged by the other host
+  * bytes_output: total bytes sent to STDOUT
+  * last_*: values at the previous sample, used to compute goodput
+*/
+typedef struct Stats_state
+{
+  uint64_t bytes_acked;
+  uint64_t bytes_output;
+  uint64_t last_bytes_acked;
+  uint64_t last_bytes_output;
+  long last_sample;
+}Stats_state;
+
+/*
+  * Store the rate limiting state of the connection
+  * send: tokens for sending data
+  * recv: tokens for receiving data
+  * window_closed: flag if the advertised window was closed for lack of tokens, the other host is told once it opens again
+*/
+typedef struct Rate_state
+{
+  rate_bucket_t send;
+  rate_bucket_t recv;
+  bool window_closed;
+}Rate_state;
+
+/*
+  * Store the keepalive and idle timeout state of the connection
+  * timer: fires when it is time to probe the other host or close the connection
+  * last_recv: time the last segment was received, in milliseconds
+  * probes: number of probes sent since then
+*/
+typedef struct Keepalive_state
+{
+  wheel_timer_t timer;
+  long last_recv;
+  uint8_t probes;
+}Keepalive_state;
+
+/*
+  * Store a run of segments received ahead of the next one expected
+  * start, end: sequence numbers of its first byte and of the byte after it
+*/
+typedef struct Ahead_range
+{
+  struct Ahead_range *next;
+  uint32_t start;
+  uint32_t end;
+}Ahead_range;
+
+/*
+  * Store the segments received ahead of the next one expected, only on multiplexed connections
+  * ranges: runs of segments received, in order
+  * ack_due: flag if the next one expected was taken and not acknowledged yet
+*/
+typedef struct Ahead_state
+{
+  Ahead_range *ranges;
+  bool ack_due;
+}Ahead_state;
+
+/*
+  * Store the keepalive and idle timeout settings, the same for every connection
+  * idle, interval, max_probes, idle_timeout: settings from the configuration, in milliseconds
+*/
+typedef struct Keepalive_config
+{
+  int idle;
+  int interval;
+  int max_probes;
+  int idle_timeout;
+}Keepalive_config;
+
 /**
  * Connection state.
  *
@@ -113,29 +235,83 @@ struct ctcp_state {
   conn_t *conn;             /* Connection object -- needed in order to figure
                                out destination when sending */
 
+  struct ctcp_state *busy_next;   /* Next in list of busy connections */
+  struct ctcp_state **busy_prev;  /* Prev in list of busy connections, NULL
+                                     if the connection is idle */
+
   /* FIXME: Add other needed fields. */
+  // Used on every segment
   Conn_state conn_state;            // Connection state
-  linked_list_t *tx_state;               // Transmit buffer state
-  linked_list_t *rx_state;               // Receive buffer state
+  linked_list_t *tx_state;          // Transmit buffer state, NULL while nothing is buffered
+  linked_list_t *rx_state;          // Receive buffer state, NULL while nothing is buffered
   ACK_state ack_state;              // Time out condition of the segment
   Teardown_state segment_teardown;  // Teardown state of the conneciton
+  RTT_state rtt_state;              // Round-trip time estimation
+  Congestion_state cong_state;      // Congestion window
+  // Used rarely
+  Keepalive_state keepalive_state;  // Probing and closing of idle connections
+  Stats_state *stats_state;         // Counters for the statistics export, NULL if disabled
+  Rate_state *rate_state;           // Token buckets for the rate limits, NULL if disabled
+  codel_t *codel_state;             // Delay of input waiting to be sent, NULL if disabled
+  mux_t *mux_state;                 // Streams multiplexed in the connection, NULL if disabled
+  Ahead_state *ahead_state;         // Segments received ahead of the next one expected, NULL unless multiplexed
 };
 
 /**
- * Linked list of connection states. Go through this in ctcp_timer() to
- * resubmit segments and tear down connections.
+ * Linked list of connection states.
  */
 static ctcp_state_t *state_list;
 
+/**
+ * Linked list of connections with data in flight or waiting to be sent or
+ * output. Go through this in ctcp_timer() to resubmit segments and tear down
+ * connections. Idle connections are left alone until their keepalive timer
+ * fires.
+ */
+static ctcp_state_t *busy_list;
+
+/**
+ * Keepalive and idle timeout settings, shared by all connections.
+ */
+static Keepalive_config keepalive_cfg;
+
+/**
+ * Retransmission timeout floor and timer interval in ms, shared by all
+ * connections.
+ */
+static int rto_min;
+static int timer_interval;
+
 /* FIXME: Feel free to add as many helper functions as needed. Don't repeat
           code! Helper functions make the code clearer and cleaner. */
 
 /******************************* Helper function prototypes *********************************/
 static void ctcp_send_flags(ctcp_state_t *state, uint32_t ackno, uint32_t flags);
-static void ctcp_receive_data_segment(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
-static void ctcp_receive_fin_with_no_ack(ctcp_state_t *state, ctcp_segment_t *segment);
+static bool ctcp_receive_data_segment(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
+static void ctcp_receive_fin(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
 static void ctcp_send_data_segment(ctcp_state_t *state, ll_node_t *tx_state_node);
-static void ctcp_send_possible_data_segment(ctcp_state_t *state);
+static void ctcp_send_possible_data_segment(ctcp_state_t *state, bool resend);
+static void ctcp_set_teardown(ctcp_state_t *state, Teardown_state teardown);
+static void ctcp_queue_fin(ctcp_state_t *state, uint32_t flags);
+static bool ctcp_fin_queued(ctcp_state_t *state);
+static bool ctcp_fin_received(ctcp_state_t *state);
+static bool ctcp_try_close(ctcp_state_t *state);
+static void ctcp_update_rtt(ctcp_state_t *state, long rtt);
+static void ctcp_set_rto(ctcp_state_t *state);
+static uint32_t ctcp_usable_window(ctcp_state_t *state);
+static void ctcp_open_cwnd(ctcp_state_t *state, uint32_t acked);
+static void ctcp_close_cwnd(ctcp_state_t *state);
+static void ctcp_sample_stats(ctcp_state_t *state, long now);
+static uint16_t ctcp_advertised_window(ctcp_state_t *state);
+static void ctcp_free_buffers(linked_list_t *list);
+static void ctcp_buffer_add(linked_list_t **list, void *object);
+static void ctcp_buffer_release(linked_list_t **list);
+static void ctcp_set_busy(ctcp_state_t *state);
+static void ctcp_set_idle(ctcp_state_t *state);
+static void ctcp_keepalive_fire(void *arg);
+static bool ctcp_receive_mux_segment(ctcp_state_t *state, ctcp_segment_t *segment, int data_seg_len);
+static void ctcp_output_mux(ctcp_state_t *state);
+static bool ctcp_output_pending(ctcp_state_t *state);
 
 ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Connection could not be established. */
@@ -159,6 +335,7 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->conn_state.last_ackno = 1;
   state->conn_state.send_window = cfg->send_window;
   state->conn_state.send_window_used = 0;
+  state->conn_state.peer_window = cfg->send_window;
   state->conn_state.rcv_window = cfg->recv_window;
   state->conn_state.rcv_window_used = 0;
 
@@ -166,30 +343,90 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->ack_state.time_out = false;
   state->ack_state.time_out_num = 0;
   state->ack_state.counter = 0;
-  state->ack_state.timer_overflow = ((cfg->rt_timeout % cfg->timer) == 0) ? (cfg->rt_timeout / cfg->timer) : (cfg->rt_timeout / cfg->timer) + 1;
   // Initiate the teardown condition
   state->segment_teardown = NO_CLOSE;
-  // Allocate linked list of tx state & rx_state
-  state->tx_state = ll_create();
-  state->rx_state = ll_create();
+  // Initiate the RTT estimation from earlier connections to the same host, nothing sent yet
+  state->rtt_state.highest_seqno = 1;
+  state->rtt_state.srtt = cfg->srtt;
+  state->rtt_state.rttvar = cfg->rttvar;
+  rto_min = cfg->rt_timeout;
+  timer_interval = cfg->timer;
+  ctcp_set_rto(state);
+  // Start with the initial window, or the one earlier connections to the same host ended with
+  state->cong_state.cwnd = cfg->initial_window * MAX_SEG_DATA_SIZE;
+  if(cfg->cwnd > state->cong_state.cwnd)
+    state->cong_state.cwnd = cfg->cwnd;
+  state->cong_state.ssthresh = cfg->ssthresh > 0 ? cfg->ssthresh : UINT32_MAX;
+  // Keep the statistics counters only if they are exported
+  if(stats_enabled)
+  {
+    state->stats_state = calloc(sizeof(Stats_state), 1);
+    state->stats_state->last_sample = current_time();
+  }
+  // Keep the token buckets only if there are rate limits, they start full
+  if(ratelimit_enabled)
+    state->rate_state = calloc(sizeof(Rate_state), 1);
+  // Keep the queue delay control only if it is turned on
+  if(codel_enabled)
+    state->codel_state = calloc(sizeof(codel_t), 1);
+  // Take segments ahead of the next one expected only if the streams are multiplexed
+  state->mux_state = conn_mux(conn);
+  if(state->mux_state != NULL)
+    state->ahead_state = calloc(sizeof(Ahead_state), 1);
+  // Initiate the keepalive, the connection was just heard from
+  state->keepalive_state.last_recv = current_time();
+  keepalive_cfg.idle = cfg->keepalive;
+  keepalive_cfg.interval = cfg->keepalive_interval;
+  keepalive_cfg.max_probes = cfg->keepalive_probes;
+  keepalive_cfg.idle_timeout = cfg->idle_timeout;
+  wheel_timer_init(&state->keepalive_state.timer, ctcp_keepalive_fire, state);
+  // Schedule the first deadline
+  if(cfg->keepalive > 0 || cfg->idle_timeout > 0)
+    ctcp_keepalive_fire(state);
+  // The linked lists of tx state & rx_state are allocated once data is buffered
 
+  TRACE(TRACE_CONN_INIT, conn_id(conn), cfg->send_window, cfg->recv_window, 0, 0);
   // Deallocate cfg pointer
   free(cfg);
   return state;
 }
 
 void ctcp_destroy(ctcp_state_t *state) {
+  TRACE(TRACE_CONN_DESTROY, conn_id(state->conn), state->conn_state.seqno, state->conn_state.ackno, 0, 0);
   /* Update linked list. */
   if (state->next)
     state->next->prev = state->prev;
 
   *state->prev = state->next;
+  ctcp_set_idle(state);
+  wheel_cancel(&state->keepalive_state.timer);
+  // Leave what was learned about the path to the next connection to this host
+  conn_save_metrics(state->conn, state->rtt_state.srtt, state->rtt_state.rttvar, state->cong_state.cwnd,
+                    state->cong_state.ssthresh == UINT32_MAX ? 0 : state->cong_state.ssthresh);
   conn_remove(state->conn);
 
-  // Destroy the 2 linked list inside the state
+  // Destroy the 2 linked list inside the state, letting go of the input shared with other connections
+  ll_node_t *node;
+  for(node = ll_front(state->tx_state); node != NULL; node = node->next)
+    shared_buf_release(((TX_state*)(node->object))->shared);
+  ctcp_free_buffers(state->tx_state);
+  ctcp_free_buffers(state->rx_state);
   ll_destroy(state->tx_state);
   ll_destroy(state->rx_state);
 
+  free(state->stats_state);
+  free(state->rate_state);
+  free(state->codel_state);
+  if(state->ahead_state != NULL)
+  {
+    Ahead_range *range, *next_range;
+    for(range = state->ahead_state->ranges; range != NULL; range = next_range)
+    {
+      next_range = range->next;
+      free(range);
+    }
+    free(state->ahead_state);
+  }
   free(state);
   state = NULL;
   end_client();
@@ -215,58 +452,458 @@ static void ctcp_send_data_segment(ctcp_state_t *state, ll_node_t *tx_state_node
   // Fill in the data segment
   data_segment->seqno = htonl(state->conn_state.next_seqno);
   data_segment->ackno = htonl(state->conn_state.ackno);
-  // Update the next_seqno number if not retransmission
+  // Update the next_seqno number if not retransmission, a FIN takes one more sequence number
   state->conn_state.next_seqno += ((TX_state*)(tx_state_node->object))->buffer_size;
+  if(((TX_state*)(tx_state_node->object))->flags & FIN)
+    state->conn_state.next_seqno++;
   ((TX_state*)(tx_state_node->object))->segment_next_seqno = state->conn_state.next_seqno;
+  // Time the segment if it is sent for the first time, stop timing it if it is resent (Karn's algorithm)
+  if(state->conn_state.next_seqno > state->rtt_state.highest_seqno)
+  {
+    state->rtt_state.highest_seqno = state->conn_state.next_seqno;
+    if(! state->rtt_state.rtt_pending)
+    {
+      state->rtt_state.rtt_pending = true;
+      state->rtt_state.rtt_seqno = state->conn_state.next_seqno;
+      state->rtt_state.rtt_start = current_time_us();
+    }
+  }
+  else if(state->rtt_state.rtt_pending && state->conn_state.next_seqno == state->rtt_state.rtt_seqno)
+    state->rtt_state.rtt_pending = false;
 
   int data_seg_len = sizeof(ctcp_segment_t) + sizeof(char) * ((TX_state*)(tx_state_node->object))->buffer_size;
   data_segment->len = htons(data_seg_len);
-  data_segment->flags = htonl(0);
-  data_segment->window = htons(MAX_SEG_DATA_SIZE * ((state->conn_state.rcv_window - state->conn_state.rcv_window_used) / MAX_SEG_DATA_SIZE));
+  data_segment->flags = htonl(((TX_state*)(tx_state_node->object))->flags);
+  data_segment->window = htons(ctcp_advertised_window(state));
   // Initiate data buffer
-  memcpy(data_segment->data, ((TX_state*)(tx_state_node->object))->tx_buffer, ((TX_state*)(tx_state_node->object))->buffer_size);
+  TX_state *tx = (TX_state*)(tx_state_node->object);
+  memcpy(data_segment->data, tx->shared != NULL ? tx->shared->data : tx->tx_buffer, tx->buffer_size);
   // Checksum
   data_segment->cksum = 0;
-  data_segment->cksum = cksum(data_segment, data_seg_len);
+  PROF_CALL(PROF_CKSUM, conn_id(state->conn), data_segment->cksum = cksum(data_segment, data_seg_len));
   byte_left = data_seg_len;
   // Send the data over the connection
   while(byte_left > 0)
   {
-    byte_sent = conn_send(state->conn, data_segment + data_seg_len - byte_left, byte_left);
+    PROF_CALL(PROF_CONN_SEND, conn_id(state->conn), byte_sent = conn_send(state->conn, (ctcp_segment_t*)((char*)data_segment + data_seg_len - byte_left), byte_left));
+    // Socket full, the segment is lost and resent at the time out like a dropped one
+    if(byte_sent <= 0)
+      break;
     byte_left -= byte_sent;
   }
   // Set time out flag 
   state->ack_state.time_out = true;
+  ctcp_set_busy(state);
   free(data_segment);
 }
 
 /*
   @brief: Function to send all the possible sending sliding window over the conneciton using Go Back N technique
   @param state: state of the current connection
-  @param tx_start_node: the start node contain data to be sent of the sliding window
+  @param resend: true to send again from the first unacknowledged segment after a time out, false to only send the segments not sent yet
   @return value: none
 */
-static void ctcp_send_possible_data_segment(ctcp_state_t *state)
+static void ctcp_send_possible_data_segment(ctcp_state_t *state, bool resend)
 {
   // Initiate the sending window used of the connection 
   state->conn_state.send_window_used = 0;
   // Update the next_seqno number of the connection
-  state->conn_state.next_seqno = state->conn_state.seqno;
+  if(resend)
+    state->conn_state.next_seqno = state->conn_state.seqno;
   // Send data over the connetion
   ll_node_t* tx_state_node = ll_front(state->tx_state);
+  uint32_t window = ctcp_usable_window(state);
+  // Always send one segment at a time out, so a closed window is probed until the other host opens it
+  if(resend && window < MAX_SEG_DATA_SIZE)
+    window = MAX_SEG_DATA_SIZE;
+  // Skip the segments in flight, they are only sent again after a time out
+  while(! resend && tx_state_node != NULL && ((TX_state*)(tx_state_node->object))->segment_next_seqno != 0 &&
+        ((TX_state*)(tx_state_node->object))->segment_next_seqno <= state->conn_state.next_seqno)
+  {
+    state->conn_state.send_window_used += ((TX_state*)(tx_state_node->object))->buffer_size;
+    tx_state_node = tx_state_node->next;
+  }
   // Send the whole sending window size
   while(tx_state_node != NULL)
   {
     // Check if we have send the whole sending window size
-    if(((TX_state*)(tx_state_node->object))->buffer_size + state->conn_state.send_window_used > state->conn_state.send_window)
+    if(((TX_state*)(tx_state_node->object))->buffer_size + state->conn_state.send_window_used > window)
+    {
+      TRACE(TRACE_WINDOW_BLOCKED, conn_id(state->conn), state->conn_state.send_window_used, window, ((TX_state*)(tx_state_node->object))->buffer_size, 0);
+      // Nothing in flight to bring back a new window, probe the other host at the time out
+      if(state->conn_state.send_window_used == 0)
+        state->ack_state.time_out = true;
       break;
+    }
+    // Stay within the sending rate, the rest goes once the bucket has filled up again
+    if(state->rate_state != NULL && ! ratelimit_take(&state->rate_state->send, RATE_SEND, ((TX_state*)(tx_state_node->object))->buffer_size))
+      break;
+    // Data that waited too long to be sent holds back reading more input
+    if(state->codel_state != NULL && ((TX_state*)(tx_state_node->object))->segment_next_seqno == 0 &&
+       ((TX_state*)(tx_state_node->object))->buffer_size > 0)
+    {
+      long now = current_time();
+      conn_hold_input(state->conn, codel_dequeue(state->codel_state, now - ((TX_state*)(tx_state_node->object))->queued_at, now));
+    }
     // Send out the sending window of the data segment
-    ctcp_send_data_segment(state, tx_state_node);
+    PROF_CALL(PROF_CTCP_SEND_DATA_SEGMENT, conn_id(state->conn), ctcp_send_data_segment(state, tx_state_node));
     // Update the used window size 
     state->conn_state.send_window_used += ((TX_state*)(tx_state_node->object))->buffer_size;
     // Move to the next segment
     tx_state_node = tx_state_node->next;
   }
+  // Everything read was sent, read input again
+  if(state->codel_state != NULL && tx_state_node == NULL)
+  {
+    codel_empty(state->codel_state);
+    conn_hold_input(state->conn, false);
+  }
+}
+
+/*
+  @brief: Function to update the teardown state of the connection
+  @param state: state of the current connection
+  @param teardown: new teardown state
+  @return value: none
+*/
+static void ctcp_set_teardown(ctcp_state_t *state, Teardown_state teardown)
+{
+  TRACE(TRACE_FIN_STATE, conn_id(state->conn), state->segment_teardown, teardown, state->conn_state.seqno, 0);
+  state->segment_teardown = teardown;
+}
+
+/*
+  @brief: Function to queue a FIN after the data still to be sent, carried on the last data segment if that one has not been sent yet
+  @param state: state of the current connection
+  @param flags: FIN for an active close, FIN + ACK for a passive close
+  @return value: none
+*/
+static void ctcp_queue_fin(ctcp_state_t *state, uint32_t flags)
+{
+  ll_node_t *tx_state_node = ll_back(state->tx_state);
+  // Piggyback the FIN on the last data segment
+  if(tx_state_node != NULL && ((TX_state*)(tx_state_node->object))->segment_next_seqno == 0)
+  {
+    ((TX_state*)(tx_state_node->object))->flags = flags;
+    return;
+  }
+  // Otherwise send the FIN in a segment of its own, retransmitted like data
+  TX_state *fin_tx = (TX_state*)calloc(sizeof(TX_state), 1);
+  fin_tx->flags = flags;
+  conn_mem_charge(state->conn, MEM_TX, sizeof(TX_state));
+  ctcp_buffer_add(&state->tx_state, fin_tx);
+  ctcp_set_busy(state);
+}
+
+/*
+  @brief: Function to check if a FIN is waiting in the transmit buffer
+  @param state: state of the current connection
+  @return value: true if the last TX state carries a FIN
+*/
+static bool ctcp_fin_queued(ctcp_state_t *state)
+{
+  ll_node_t *tx_state_node = ll_back(state->tx_state);
+  return tx_state_node != NULL && (((TX_state*)(tx_state_node->object))->flags & FIN);
+}
+
+/*
+  @brief: Function to check if the other host's FIN was received, nothing more comes from it
+  @param state: state of the current connection
+  @return value: true if it was
+*/
+static bool ctcp_fin_received(ctcp_state_t *state)
+{
+  return state->segment_teardown == PASSIVE_CLOSE || state->segment_teardown == CLOSING;
+}
+
+/*
+  @brief: Function to update the round-trip time estimation with a new sample (RFC 6298)
+  @param state: state of the current connection
+  @param rtt: round-trip time sample in microseconds
+  @return value: none
+*/
+static void ctcp_update_rtt(ctcp_state_t *state, long rtt)
+{
+  // First sample
+  if(state->rtt_state.srtt == 0)
+  {
+    state->rtt_state.srtt = rtt;
+    state->rtt_state.rttvar = rtt / 2;
+  }
+  else
+  {
+    long delta = state->rtt_state.srtt > rtt ? state->rtt_state.srtt - rtt : rtt - state->rtt_state.srtt;
+    state->rtt_state.rttvar = (3 * state->rtt_state.rttvar + delta) / 4;
+    state->rtt_state.srtt = (7 * state->rtt_state.srtt + rtt) / 8;
+  }
+  ctcp_set_rto(state);
+}
+
+/*
+  @brief: Function to set the retransmission timeout to SRTT + 4 * RTTVAR (RFC 6298), never below the configured rt_timeout
+  @param state: state of the current connection
+  @return value: none
+*/
+static void ctcp_set_rto(ctcp_state_t *state)
+{
+  long rto = rto_min;
+  if(state->rtt_state.srtt > 0 && (state->rtt_state.srtt + 4 * state->rtt_state.rttvar) / 1000 > rto)
+    rto = (state->rtt_state.srtt + 4 * state->rtt_state.rttvar) / 1000;
+  // Count the timeout in calls to ctcp_timer()
+  long ticks = (rto + timer_interval - 1) / timer_interval;
+  state->ack_state.timer_overflow = ticks > UINT8_MAX ? UINT8_MAX : ticks;
+}
+
+/*
+  @brief: Function to compute how many bytes may be in flight, limited by both the other host's window and the congestion window
+  @param state: state of the current connection
+  @return value: window size in bytes
+*/
+static uint32_t ctcp_usable_window(ctcp_state_t *state)
+{
+  uint32_t window = state->cong_state.cwnd < state->conn_state.send_window ? state->cong_state.cwnd : state->conn_state.send_window;
+  // Follow the window last advertised by the other host
+  return window < state->conn_state.peer_window ? window : state->conn_state.peer_window;
+}
+
+/*
+  @brief: Function to grow the congestion window once new data is acknowledged, by the bytes acknowledged in slow start and by about one segment per window afterwards (RFC 5681)
+  @param state: state of the current connection
+  @param acked: number of bytes newly acknowledged
+  @return value: none
+*/
+static void ctcp_open_cwnd(ctcp_state_t *state, uint32_t acked)
+{
+  Congestion_state *cong = &state->cong_state;
+  // Do not grow past what the other host lets us send, the window would not be tested
+  if(cong->cwnd >= state->conn_state.send_window)
+    return;
+  if(cong->cwnd < cong->ssthresh)
+    cong->cwnd += acked < MAX_SEG_DATA_SIZE ? acked : MAX_SEG_DATA_SIZE;
+  else
+  {
+    uint32_t increase = (uint32_t)MAX_SEG_DATA_SIZE * MAX_SEG_DATA_SIZE / cong->cwnd;
+    cong->cwnd += increase > 0 ? increase : 1;
+  }
+}
+
+/*
+  @brief: Function to shrink the congestion window after a time out, back to one segment with the threshold at half the data in flight (RFC 5681)
+  @param state: state of the current connection
+  @return value: none
+*/
+static void ctcp_close_cwnd(ctcp_state_t *state)
+{
+  uint32_t inflight = state->conn_state.next_seqno - state->conn_state.seqno;
+  state->cong_state.ssthresh = inflight / 2 > 2 * MAX_SEG_DATA_SIZE ? inflight / 2 : 2 * MAX_SEG_DATA_SIZE;
+  state->cong_state.cwnd = MAX_SEG_DATA_SIZE;
+}
+
+/*
+  @brief: Function to write the current state of the connection into the statistics file
+  @param state: state of the current connection
+  @param now: current time in milliseconds
+  @return value: none
+*/
+static void ctcp_sample_stats(ctcp_state_t *state, long now)
+{
+  stats_sample_t sample;
+  Stats_state *stats = state->stats_state;
+  long elapsed = now - stats->last_sample;
+  if(elapsed <= 0)
+    elapsed = 1;
+
+  sample.conn_id = conn_id(state->conn);
+  sample.send_window = state->conn_state.send_window;
+  sample.send_window_used = state->conn_state.send_window_used;
+  sample.rcv_window = state->conn_state.rcv_window;
+  sample.rcv_window_used = state->conn_state.rcv_window_used;
+  sample.inflight = state->conn_state.next_seqno - state->conn_state.seqno;
+  sample.srtt = state->rtt_state.srtt;
+  sample.rttvar = state->rtt_state.rttvar;
+  sample.bytes_acked = stats->bytes_acked;
+  sample.bytes_output = stats->bytes_output;
+  sample.tx_goodput = (stats->bytes_acked - stats->last_bytes_acked) * 1000 / elapsed;
+  sample.rx_goodput = (stats->bytes_output - stats->last_bytes_output) * 1000 / elapsed;
+  stats_write(now, &sample);
+
+  // Remember the counters for the next goodput computation
+  stats->last_bytes_acked = stats->bytes_acked;
+  stats->last_bytes_output = stats->bytes_output;
+  stats->last_sample = now;
+}
+
+/*
+  @brief: Function to compute the receive window advertised to the other host
+  @param state: state of the current connection
+  @return value: window size in bytes
+*/
+static uint16_t ctcp_advertised_window(ctcp_state_t *state)
+{
+  uint16_t window = MAX_SEG_DATA_SIZE * ((state->conn_state.rcv_window - state->conn_state.rcv_window_used) / MAX_SEG_DATA_SIZE);
+  // Only let the other host send what the receiving rate allows, and tell it once the window opens again
+  if(state->rate_state != NULL)
+  {
+    long tokens = ratelimit_available(&state->rate_state->recv, RATE_RECV);
+    if(tokens < window)
+    {
+      window = MAX_SEG_DATA_SIZE * (tokens / MAX_SEG_DATA_SIZE);
+      if(window == 0)
+      {
+        state->rate_state->window_closed = true;
+        ctcp_set_busy(state);
+      }
+    }
+  }
+  // Shrink the window while the connection holds too much memory
+  switch(conn_mem_pressure(state->conn))
+  {
+    case MEM_PRESSURE_HARD:
+      return 0;
+    case MEM_PRESSURE_SOFT:
+      return window < MAX_SEG_DATA_SIZE ? window : MAX_SEG_DATA_SIZE;
+    default:
+      return window;
+  }
+}
+
+/*
+  @brief: Function to free the buffers still held in a TX or RX list
+  @param list: the list of TX_state or RX_state objects
+  @return value: none
+*/
+static void ctcp_free_buffers(linked_list_t *list)
+{
+  ll_node_t *node;
+  for(node = ll_front(list); node != NULL; node = node->next)
+  {
+    free(node->object);
+    node->object = NULL;
+  }
+}
+
+/*
+  @brief: Function to append a TX or RX state to its list, allocating the list if nothing was buffered
+  @param list: the list of TX_state or RX_state objects
+  @param object: the TX_state or RX_state to append
+  @return value: none
+*/
+static void ctcp_buffer_add(linked_list_t **list, void *object)
+{
+  if(*list == NULL)
+    *list = ll_create();
+  ll_add(*list, object);
+}
+
+/*
+  @brief: Function to free a TX or RX list once it is empty, so idle connections do not hold list headers
+  @param list: the list of TX_state or RX_state objects
+  @return value: none
+*/
+static void ctcp_buffer_release(linked_list_t **list)
+{
+  if(*list == NULL || ll_length(*list) > 0)
+    return;
+  ll_destroy(*list);
+  *list = NULL;
+}
+
+/*
+  @brief: Function to add the connection to the busy list walked by ctcp_timer()
+  @param state: state of the current connection
+  @return value: none
+*/
+static void ctcp_set_busy(ctcp_state_t *state)
+{
+  if(state->busy_prev != NULL)
+    return;
+  state->busy_next = busy_list;
+  state->busy_prev = &busy_list;
+  if(busy_list)
+    busy_list->busy_prev = &state->busy_next;
+  busy_list = state;
+}
+
+/*
+  @brief: Function to remove the connection from the busy list once it has nothing to send, retransmit or output
+  @param state: state of the current connection
+  @return value: none
+*/
+static void ctcp_set_idle(ctcp_state_t *state)
+{
+  if(state->busy_prev == NULL)
+    return;
+  if(state->busy_next)
+    state->busy_next->busy_prev = state->busy_prev;
+  *state->busy_prev = state->busy_next;
+  state->busy_next = NULL;
+  state->busy_prev = NULL;
+}
+
+/*
+  @brief: Function called by the timer wheel when the connection may have been idle long enough to probe the other host or close the connection
+  @param arg: state of the current connection
+  @return value: none
+*/
+static void ctcp_keepalive_fire(void *arg)
+{
+  ctcp_state_t *state = (ctcp_state_t*)arg;
+  Keepalive_state *keepalive = &state->keepalive_state;
+  long idle = current_time() - keepalive->last_recv;
+  long next = -1;
+
+  // Close the connection once it has been idle for too long
+  if(keepalive_cfg.idle_timeout > 0)
+  {
+    if(idle >= keepalive_cfg.idle_timeout)
+    {
+      TRACE(TRACE_IDLE_CLOSE, conn_id(state->conn), idle, keepalive->probes, 0, 0);
+      // Drop it if the other host did not answer our FIN either
+      if(state->segment_teardown == ACTIVE_CLOSE || state->segment_teardown == CLOSING)
+      {
+        ctcp_destroy(state);
+        return;
+      }
+      // Close our side after what is still queued, the other host closed its side already
+      if(state->segment_teardown == PASSIVE_CLOSE)
+      {
+        ctcp_set_teardown(state, CLOSING);
+        ctcp_queue_fin(state, FIN | ACK);
+      }
+      else
+      {
+        ctcp_set_teardown(state, ACTIVE_CLOSE);
+        ctcp_queue_fin(state, FIN);
+      }
+      ctcp_send_possible_data_segment(state, false);
+      // Give the other host as long again to answer
+      next = keepalive_cfg.idle_timeout;
+    }
+    else
+      next = keepalive_cfg.idle_timeout - idle;
+  }
+  // Probe the other host, and drop the connection if it stopped answering
+  if(keepalive_cfg.idle > 0)
+  {
+    long due = keepalive_cfg.idle + (long)keepalive->probes * keepalive_cfg.interval;
+    if(idle >= due)
+    {
+      if(keepalive->probes >= keepalive_cfg.max_probes)
+      {
+        TRACE(TRACE_IDLE_CLOSE, conn_id(state->conn), idle, keepalive->probes, 0, 0);
+        ctcp_destroy(state);
+        return;
+      }
+      keepalive->probes++;
+      TRACE(TRACE_KEEPALIVE, conn_id(state->conn), keepalive->probes, idle, 0, 0);
+      // A segment without data or flags, the other host answers with an ACK
+      ctcp_send_flags(state, state->conn_state.ackno, 0);
+      due += keepalive_cfg.interval;
+    }
+    if(next < 0 || due - idle < next)
+      next = due - idle;
+  }
+  wheel_schedule(&keepalive->timer, next);
 }
 
 void ctcp_read(ctcp_state_t *state) 
@@ -274,8 +911,24 @@ void ctcp_read(ctcp_state_t *state)
   int byte_read = 0;
   // Initiate the buffer for reading input from user
   size_t read_len = MAX_SEG_DATA_SIZE;
+  // Nothing is sent after our FIN
+  if(state->segment_teardown == ACTIVE_CLOSE || state->segment_teardown == CLOSING)
+    return;
   char *tx_buffer = (char*)calloc(sizeof(char) * read_len, 1);
 
+  // Take the input broadcast to every connection, it is kept once for all of them
+  shared_buf_t *shared;
+  while((byte_read = conn_input_shared(state->conn, &shared)) > 0)
+  {
+    TX_state *segemnt_tx = (TX_state*)calloc(sizeof(TX_state), 1);
+    segemnt_tx->shared = shared;
+    segemnt_tx->buffer_size = byte_read;
+    if(state->codel_state != NULL)
+      segemnt_tx->queued_at = current_time();
+    conn_mem_charge(state->conn, MEM_TX, sizeof(TX_state) + byte_read);
+    ctcp_buffer_add(&state->tx_state, segemnt_tx);
+    ctcp_set_busy(state);
+  }
   // Read input from STDIN
   while((byte_read = conn_input(state->conn, tx_buffer, read_len)) >= -1)
   {
@@ -284,16 +937,18 @@ void ctcp_read(ctcp_state_t *state)
     // Case read EOF
     else if(byte_read == -1)
     {
-      // Send out all of the data to STDOUT
-      while(state->rx_state->length > 0);
-      // Send all read data over the connection
-      while(state->tx_state->length > 0);
-      // Update the teardown state
-      state->segment_teardown = ACTIVE_CLOSE;
-      // Send FIN to close the socket
-      ctcp_send_flags(state, state->conn_state.ackno, FIN);
-      // Set time out flag 
-      state->ack_state.time_out = true;
+      // Send FIN after the data read so far to close our side of the connection
+      if(state->segment_teardown == NO_CLOSE)
+      {
+        ctcp_set_teardown(state, ACTIVE_CLOSE);
+        ctcp_queue_fin(state, FIN);
+      }
+      // The other host closed its side already, our FIN also acknowledges its FIN
+      else
+      {
+        ctcp_set_teardown(state, CLOSING);
+        ctcp_queue_fin(state, FIN | ACK);
+      }
       break;
     }
     // Check if read truncated message
@@ -311,15 +966,19 @@ void ctcp_read(ctcp_state_t *state)
     TX_state *segemnt_tx = (TX_state*)calloc(sizeof(TX_state) + sizeof(char) * byte_read, 1);
     memcpy(segemnt_tx->tx_buffer, tx_buffer, byte_read);
     segemnt_tx->buffer_size = byte_read;
+    if(state->codel_state != NULL)
+      segemnt_tx->queued_at = current_time();
+    conn_mem_charge(state->conn, MEM_TX, sizeof(TX_state) + byte_read);
     
     // Add the new TX state to the linked list
-    ll_add(state->tx_state, segemnt_tx);
+    ctcp_buffer_add(&state->tx_state, segemnt_tx);
+    ctcp_set_busy(state);
   }
   // Deallocated the tx buffer
   free(tx_buffer);
   tx_buffer = NULL;
   // Send all possisble data segment of the sliding window
-  ctcp_send_possible_data_segment(state);
+  ctcp_send_possible_data_segment(state, false);
 }
 
 /*
@@ -339,16 +998,18 @@ static void ctcp_send_flags(ctcp_state_t *state, uint32_t ackno, uint32_t flags)
   ack_segment->ackno = htonl(ackno);
   ack_segment->len = htons(segment_len);
   ack_segment->flags |= htonl(flags);
-  // ack_segment->window = htons(MAX_SEG_DATA_SIZE * ((state->conn_state.rcv_window - state->conn_state.rcv_window_used) / MAX_SEG_DATA_SIZE));
-  ack_segment->window = htons(MAX_SEG_DATA_SIZE * ((state->conn_state.rcv_window - state->conn_state.rcv_window_used) / MAX_SEG_DATA_SIZE));
+  ack_segment->window = htons(ctcp_advertised_window(state));
   // Get the checksum number of the segment
   ack_segment->cksum = 0;
-  ack_segment->cksum = cksum(ack_segment, segment_len);
+  PROF_CALL(PROF_CKSUM, conn_id(state->conn), ack_segment->cksum = cksum(ack_segment, segment_len));
 
   // Send the ACK to the IP socket
   while(byte_left > 0)
   {
-    byte_sent = conn_send(state->conn, (ack_segment + segment_len - byte_left), byte_left);
+    PROF_CALL(PROF_CONN_SEND, conn_id(state->conn), byte_sent = conn_send(state->conn, (ctcp_segment_t*)((char*)ack_segment + segment_len - byte_left), byte_left));
+    // Socket full, the segment is lost like a dropped one
+    if(byte_sent <= 0)
+      break;
     byte_left -= byte_sent;
   }
   free(ack_segment);
@@ -359,14 +1020,24 @@ static void ctcp_send_flags(ctcp_state_t *state, uint32_t ackno, uint32_t flags)
   * Param state: state of the current conneciton
   * Param sgement: data segment received from socket
   * Param len: length of the received data segment
-  * Return value: none
+  * Return value: true if the data was added to the receive window
 */
-static void ctcp_receive_data_segment(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
+static bool ctcp_receive_data_segment(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
 {
   // Get the actual data length
   int data_seg_len = len - sizeof(ctcp_segment_t);
-  // Add new data segment into the receive sliding window
-  if(state->conn_state.rcv_window_used + data_seg_len <= state->conn_state.rcv_window)
+  // Streams multiplexed in the connection take segments ahead of the next one expected too
+  if(state->mux_state != NULL)
+    return ctcp_receive_mux_segment(state, segment, data_seg_len);
+  // Only take the next segment in order, the sender goes back to the first unacknowledged one
+  if(ntohl(segment->seqno) != state->conn_state.ackno)
+  {
+    ctcp_send_flags(state, state->conn_state.ackno, ACK);
+    return false;
+  }
+  // Add new data segment into the receive sliding window, drop it if the connection holds too much memory or receives faster than allowed
+  if(state->conn_state.rcv_window_used + data_seg_len <= state->conn_state.rcv_window && conn_mem_pressure(state->conn) != MEM_PRESSURE_HARD &&
+     (state->rate_state == NULL || ratelimit_take(&state->rate_state->recv, RATE_RECV, data_seg_len)))
   {
     // Update the ACK number of the connection
     state->conn_state.last_ackno = state->conn_state.ackno;
@@ -377,60 +1048,150 @@ static void ctcp_receive_data_segment(ctcp_state_t *state, ctcp_segment_t *segme
     memcpy(rx_state_node->rx_buffer, segment->data, data_seg_len);
     rx_state_node->byte_left = data_seg_len;
     rx_state_node->byte_used = 0;
+    conn_mem_charge(state->conn, MEM_RX, sizeof(RX_state) + data_seg_len);
 
     // Update the used received window size
     state->conn_state.rcv_window_used += data_seg_len;
     // Add segment node into the sliding window
-    ll_add(state->rx_state, rx_state_node);
+    ctcp_buffer_add(&state->rx_state, rx_state_node);
+    ctcp_set_busy(state);
+    return true;
   }
-  // Output data to STDOUT
-  ctcp_output(state);
+  // No room, tell the sender the window it probed is still closed
+  ctcp_send_flags(state, state->conn_state.ackno, ACK);
+  return false;
 }
 
 /*
-  * Function to handle the reception of FIN 
+  @brief: Function to take a data segment of a connection with multiplexed streams. Segments ahead of the next one expected are taken too and their data handed to its stream, so a lost segment only holds up its own stream
+  @param state: state of the current connection
+  @param segment: received data segment
+  @param data_seg_len: length of the data carried
+  @return value: true if the segment was the next one expected and was taken
+*/
+static bool ctcp_receive_mux_segment(ctcp_state_t *state, ctcp_segment_t *segment, int data_seg_len)
+{
+  uint32_t seqno = ntohl(segment->seqno);
+  uint32_t ahead = seqno - state->conn_state.ackno;
+  int held = -1;
+  // Only take what fits in the window, anything below the next one expected was taken before
+  if(ahead < state->conn_state.rcv_window && state->conn_state.rcv_window_used + data_seg_len <= state->conn_state.rcv_window &&
+     conn_mem_pressure(state->conn) != MEM_PRESSURE_HARD &&
+     (state->rate_state == NULL || ratelimit_take(&state->rate_state->recv, RATE_RECV, data_seg_len)))
+    held = mux_receive(state->mux_state, segment->data, data_seg_len, state->conn_state.rcv_window);
+  // No room in the window or in its stream, the sender sends it again
+  if(held < 0)
+  {
+    ctcp_send_flags(state, state->conn_state.ackno, ACK);
+    return false;
+  }
+  state->conn_state.rcv_window_used += held;
+  conn_mem_charge(state->conn, MEM_RX, held);
+  ctcp_set_busy(state);
+
+  // Remember the segment, merged with the runs next to it
+  Ahead_range **pos = &state->ahead_state->ranges;
+  while(*pos != NULL && (*pos)->end < seqno)
+    pos = &(*pos)->next;
+  if(*pos != NULL && (*pos)->start <= seqno + data_seg_len)
+  {
+    if(seqno < (*pos)->start)
+      (*pos)->start = seqno;
+    if(seqno + data_seg_len > (*pos)->end)
+      (*pos)->end = seqno + data_seg_len;
+    // It may have closed the gap to the next run
+    Ahead_range *next_range = (*pos)->next;
+    if(next_range != NULL && next_range->start <= (*pos)->end)
+    {
+      if(next_range->end > (*pos)->end)
+        (*pos)->end = next_range->end;
+      (*pos)->next = next_range->next;
+      free(next_range);
+    }
+  }
+  else
+  {
+    Ahead_range *range = calloc(sizeof(Ahead_range), 1);
+    range->start = seqno;
+    range->end = seqno + data_seg_len;
+    range->next = *pos;
+    *pos = range;
+  }
+  // Ahead of the next one expected, tell the sender which one is still missing
+  if(ahead > 0)
+  {
+    ctcp_send_flags(state, state->conn_state.ackno, ACK);
+    return false;
+  }
+  // The next one expected, acknowledge the run it starts
+  Ahead_range *first = state->ahead_state->ranges;
+  state->conn_state.last_ackno = state->conn_state.ackno;
+  state->conn_state.ackno = first->end;
+  state->ahead_state->ranges = first->next;
+  state->ahead_state->ack_due = true;
+  free(first);
+  return true;
+}
+
+/*
+  * Function to handle the reception of FIN, which may be carried on the last data segment
   * Param state: state of the current connection
   * Param segment: received data segment
+  * Param len: length of the received segment
   * Return value: none
 */
-static void ctcp_receive_fin_with_no_ack(ctcp_state_t *state, ctcp_segment_t *segment)
+static void ctcp_receive_fin(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
 {
-  // Update the ackno of the conenction
-  state->conn_state.last_ackno = state->conn_state.ackno;
-  state->conn_state.ackno = ntohl(segment->seqno) + 1;
-  // Case server passive close
-  if(state->segment_teardown != ACTIVE_CLOSE)
+  int data_seg_len = len - sizeof(ctcp_segment_t);
+  // Only take the FIN in order, and if the data carried with it was taken
+  if(ntohl(segment->seqno) != state->conn_state.ackno)
   {
-    // Send EOF to STDOUT
-    conn_output(state->conn, NULL, 0);
-    // Send ACK after received FIN
     ctcp_send_flags(state, state->conn_state.ackno, ACK);
-    // Send out all of the data to STDOUT
-    while(state->rx_state->length > 0);
-    // Send FIN back
-    ctcp_send_flags(state, state->conn_state.ackno, FIN);
-    // Raise timeout flag 
-    state->ack_state.time_out = true;
+    return;
+  }
+  if(data_seg_len > 0)
+  {
+    if(! ctcp_receive_data_segment(state, segment, len))
+      return;
+  }
+  else
+    state->conn_state.last_ackno = state->conn_state.ackno;
+  // Update the ackno of the conenction, the FIN takes one sequence number
+  state->conn_state.ackno = ntohl(segment->seqno) + data_seg_len + 1;
+  // Case passive close, we keep sending until our input ends
+  if(state->segment_teardown == NO_CLOSE)
+  {
     // Update the teardown state
-    state->segment_teardown = PASSIVE_CLOSE;
+    ctcp_set_teardown(state, PASSIVE_CLOSE);
+    // Send the data left and then EOF to STDOUT
+    ctcp_output(state);
+    // Our input may have ended already, then our FIN acknowledges the FIN too, otherwise it is sent once our input ends
+    uint32_t next_seqno = state->conn_state.next_seqno;
+    ctcp_read(state);
+    // Acknowledge the FIN on its own only if no segment carrying the ackno went out
+    if(state->conn_state.next_seqno == next_seqno)
+      ctcp_send_flags(state, state->conn_state.ackno, ACK);
   }
-  // Case client receive the 2nd FIN
+  // Case receive the 2nd FIN
   else if(state->segment_teardown == ACTIVE_CLOSE)
   {
+    ctcp_set_teardown(state, CLOSING);
+    ctcp_output(state);
     // Send ACK after received FIN
     ctcp_send_flags(state, state->conn_state.ackno, ACK);
-    // Close the connection
-    ctcp_destroy(state);
+    // Close the connection once our FIN is acknowledged too
+    ctcp_try_close(state);
   }
 }
 
 void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) 
 {
-  // Verify duplicate data segment and resend ackno for the last segment
+  // Verify duplicate data segment and resend the ackno, the ACK for it may have been lost
   if(ntohl(segment->seqno) != state->conn_state.ackno && ntohl(segment->seqno) == state->conn_state.last_ackno && (! (ntohl(segment->flags) & ACK)))
   {
-    // Resend the last ACK segment
-    ctcp_send_flags(state, state->conn_state.last_ackno, ACK);
+    TRACE(TRACE_DUP_ACK, conn_id(state->conn), ntohl(segment->seqno), state->conn_state.last_ackno, 0, 0);
+    // Acknowledge everything received so far, acknowledging only up to the duplicate would not move the sender on
+    ctcp_send_flags(state, state->conn_state.ackno, ACK);
     free(segment);
     return;
   }
@@ -443,12 +1204,19 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
   // Verify the checksum field of the data
   uint16_t segment_check_sum = segment->cksum;
   segment->cksum = 0;
-  if(segment_check_sum != cksum(segment, len))
+  uint16_t computed_check_sum;
+  PROF_CALL(PROF_CKSUM, conn_id(state->conn), computed_check_sum = cksum(segment, len));
+  if(segment_check_sum != computed_check_sum)
   {
     free(segment);
     return;
   }
   segment->cksum = segment_check_sum;
+  // Window the other host can take now
+  state->conn_state.peer_window = ntohs(segment->window);
+  // The other host is alive
+  state->keepalive_state.last_recv = current_time();
+  state->keepalive_state.probes = 0;
 
   // Intiiate some variables
   Segment_type cur_seg_type;
@@ -471,23 +1239,31 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
   {
     case DATA_SEG:
     {
+      // Keepalive probe, only needs an ACK
+      if(len == sizeof(ctcp_segment_t))
+      {
+        ctcp_send_flags(state, state->conn_state.ackno, ACK);
+        break;
+      }
       ctcp_receive_data_segment(state, segment, len);
+      // Output data to STDOUT
+      ctcp_output(state);
     }
     break;
 
     case ACK_SEG:
     {
-      // Teardown the connection if this is the last ACK
-      if(state->segment_teardown == PASSIVE_CLOSE)
-      {
-        ctcp_destroy(state);
-        return; 
-      }
       ll_node_t* tx_state_node = ll_front(state->tx_state);
       if(tx_state_node == NULL)
+      {
+        // Teardown the connection if this is the last ACK
+        ctcp_try_close(state);
+        free(segment);
         return;
+      }
       uint32_t next_seqno = ((TX_state*)(tx_state_node->object))->segment_next_seqno;
       uint32_t segment_ackno = ntohl(segment->ackno);
+      uint32_t old_seqno = state->conn_state.seqno;
       // Handle cummulative acknowledgement
       if(segment_ackno >= next_seqno)
       {
@@ -497,7 +1273,11 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
           state->conn_state.seqno = ((TX_state*)(tx_state_node->object))->segment_next_seqno;
           // Update the used sending window size
           state->conn_state.send_window_used -= ((TX_state*)(tx_state_node->object))->buffer_size;
+          if(state->stats_state)
+            state->stats_state->bytes_acked += ((TX_state*)(tx_state_node->object))->buffer_size;
           // Deallocate the head of tx state
+          conn_mem_charge(state->conn, MEM_TX, -(long)(sizeof(TX_state) + ((TX_state*)(tx_state_node->object))->buffer_size));
+          shared_buf_release(((TX_state*)(tx_state_node->object))->shared);
           free(tx_state_node->object);
           tx_state_node->object = NULL;
           // Move to the next node and delete the head node of the linked list
@@ -510,6 +1290,18 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
           }
           ll_remove(state->tx_state, ll_front(state->tx_state));
         }
+        ctcp_buffer_release(&state->tx_state);
+        // Acknowledged past what was sent again after a time out, go on from there
+        if(state->conn_state.next_seqno < state->conn_state.seqno)
+          state->conn_state.next_seqno = state->conn_state.seqno;
+        // Grow the congestion window by the data acknowledged
+        ctcp_open_cwnd(state, state->conn_state.seqno - old_seqno);
+        // Take a round-trip time sample if the timed segment is acknowledged
+        if(state->rtt_state.rtt_pending && segment_ackno >= state->rtt_state.rtt_seqno)
+        {
+          state->rtt_state.rtt_pending = false;
+          ctcp_update_rtt(state, current_time_us() - state->rtt_state.rtt_start);
+        }
         // Deactivate time out flag
         if(segment_ackno == state->conn_state.next_seqno)
           state->ack_state.time_out = false;
@@ -517,24 +1309,28 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
         state->ack_state.counter = 0;
         state->ack_state.time_out_num = 0; 
       }
-      
+      else
+      {
+        TRACE(TRACE_DUP_ACK, conn_id(state->conn), ntohl(segment->seqno), segment_ackno, 0, 0);
+        // The other host answered a probe of its closed window, or of a stream with no room, it is alive and only slow to make room
+        if(state->conn_state.peer_window < MAX_SEG_DATA_SIZE || state->mux_state != NULL)
+          state->ack_state.time_out_num = 0;
+      }
+      // Send what the window now has room for, it may have opened without new data being acknowledged
+      ctcp_send_possible_data_segment(state, false);
+      // Teardown the connection once our FIN is acknowledged
+      if(ctcp_try_close(state))
+      {
+        free(segment);
+        return;
+      }
     }
     break;
 
     case FIN_WITH_ACK:
-    {
-      // Update the ackno number
-      state->conn_state.ackno = ntohl(segment->seqno) + 1;
-      // Send back the last ACK
-      ctcp_send_flags(state, state->conn_state.ackno, ACK);
-      // Teardown the conneciton
-      ctcp_destroy(state);
-    }
-    break;
-
     case FIN_WITH_NO_ACK:
     {
-      ctcp_receive_fin_with_no_ack(state, segment);
+      ctcp_receive_fin(state, segment, len);
     }
     break;
 
@@ -547,11 +1343,48 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
   free(segment);
 }
 
+/*
+  @brief: Function to output the data of the streams multiplexed in the connection, each as far as it is in order
+  @param state: state of the current connection
+  @return value: none
+*/
+static void ctcp_output_mux(ctcp_state_t *state)
+{
+  size_t released = mux_output(state->mux_state, state->conn);
+  state->conn_state.rcv_window_used -= released;
+  conn_mem_charge(state->conn, MEM_RX, -(long)released);
+  if(state->stats_state)
+    state->stats_state->bytes_output += released;
+  // Acknowledge what was taken and the room made, no need after a FIN was received since nothing more comes
+  if((released > 0 || state->ahead_state->ack_due) && ! ctcp_fin_received(state))
+    ctcp_send_flags(state, state->conn_state.ackno, ACK);
+  state->ahead_state->ack_due = false;
+  // All data received before the FIN is out, send EOF to STDOUT
+  if(ctcp_fin_received(state) && mux_held(state->mux_state) == 0)
+    conn_output(state->conn, NULL, 0);
+}
+
+/*
+  @brief: Function to check if received data is waiting to be output
+  @param state: state of the current connection
+  @return value: true if some is waiting
+*/
+static bool ctcp_output_pending(ctcp_state_t *state)
+{
+  if(state->mux_state != NULL)
+    return mux_held(state->mux_state) > 0;
+  return ll_length(state->rx_state) > 0;
+}
+
 void ctcp_output(ctcp_state_t *state) {
+  // Streams multiplexed in the connection are output on their own
+  if(state->mux_state != NULL)
+  {
+    ctcp_output_mux(state);
+    return;
+  }
   // Get the head of the receive sliding window
   ll_node_t* rx_state_node = ll_front(state->rx_state);
-  if(rx_state_node == NULL)
-    return;
 
   // Check if there is enough available space to output to STDOUT
   while(rx_state_node != NULL)
@@ -559,7 +1392,10 @@ void ctcp_output(ctcp_state_t *state) {
     // Get the availabe space
     size_t avai_space = conn_bufspace(state->conn);
     if(! avai_space || ((RX_state*)(rx_state_node->object))->byte_left > avai_space)
+    {
+      TRACE(TRACE_OUTPUT_BLOCKED, conn_id(state->conn), avai_space, ((RX_state*)(rx_state_node->object))->byte_left, 0, 0);
       break;
+    }
     
     // Actually output the buffer to the STDOUT
     int byte_sent = conn_output(state->conn, (((RX_state*)(rx_state_node->object))->rx_buffer + ((RX_state*)(rx_state_node->object))->byte_used), ((RX_state*)(rx_state_node->object))->byte_left);
@@ -568,13 +1404,17 @@ void ctcp_output(ctcp_state_t *state) {
     ((RX_state*)(rx_state_node->object))->byte_left -= byte_sent;
     // Update the receive window used
     state->conn_state.rcv_window_used -= byte_sent;
+    if(state->stats_state)
+      state->stats_state->bytes_output += byte_sent;
 
     // Flow control and deallocation of buffer
     if(((RX_state*)(rx_state_node->object))->byte_left <= 0)
     {
-      // Send out ACK for the buffer
-      ctcp_send_flags(state, state->conn_state.ackno, ACK);
+      // Send out ACK for the buffer, no need after a FIN was received since nothing more comes
+      if(! ctcp_fin_received(state))
+        ctcp_send_flags(state, state->conn_state.ackno, ACK);
       // Deallocate buffer for the rx state node
+      conn_mem_charge(state->conn, MEM_RX, -(long)(sizeof(RX_state) + ((RX_state*)(rx_state_node->object))->byte_used));
       free(rx_state_node->object);
       rx_state_node->object = NULL;
     }
@@ -585,23 +1425,55 @@ void ctcp_output(ctcp_state_t *state) {
     // Delete the last node
     ll_remove(state->rx_state, ll_front(state->rx_state));
   }
+  ctcp_buffer_release(&state->rx_state);
+  // All data received before the FIN is out, send EOF to STDOUT
+  if(ctcp_fin_received(state) && ll_length(state->rx_state) == 0)
+    conn_output(state->conn, NULL, 0);
+}
+
+/*
+  @brief: Function to close the connection once both sides are done: our FIN acknowledged, and the other host's FIN received and everything before it output
+  @param state: state of the current connection
+  @return value: true if the connection was destroyed
+*/
+static bool ctcp_try_close(ctcp_state_t *state)
+{
+  if(state->segment_teardown != CLOSING || ll_length(state->tx_state) > 0 || ctcp_output_pending(state))
+    return false;
+  ctcp_destroy(state);
+  return true;
 }
 
 void ctcp_timer() {
+  // Fire the keepalive timers that are due, this may close connections
+  wheel_advance(current_time());
+  // Pick up new rate limits
+  ratelimit_poll();
   // Verify the existence of state list 
   if(state_list == NULL)
     return;
-  // Get the head of the state list
-  ctcp_state_t *cur_state = state_list;
-  // Traverse the state linked list
-  while(cur_state != NULL)
+  ctcp_state_t *cur_state, *next_state;
+  // Export the state of every connection once per sampling interval
+  if(stats_enabled)
+  {
+    long now = current_time();
+    if(stats_due(now))
+    {
+      for(cur_state = state_list; cur_state != NULL; cur_state = cur_state->next)
+        ctcp_sample_stats(cur_state, now);
+    }
+  }
+  // Traverse the busy connections only, idle ones have nothing to do
+  for(cur_state = busy_list; cur_state != NULL; cur_state = next_state)
   {
+    next_state = cur_state->busy_next;
     // Check timeout condition
     if(cur_state->ack_state.time_out)
     {
       if(++(cur_state->ack_state.counter) == cur_state->ack_state.timer_overflow)
       {
         cur_state->ack_state.counter = 0;
+        TRACE(TRACE_TIMEOUT, conn_id(cur_state->conn), cur_state->ack_state.time_out_num + 1, cur_state->conn_state.seqno, cur_state->conn_state.next_seqno, 0);
         // Teardown connection at the 6th time out
         if(++(cur_state->ack_state.time_out_num) == 6)
         {
@@ -610,33 +1482,51 @@ void ctcp_timer() {
           // Set time out for FIN
           cur_state->ack_state.time_out = true;
           // Update teardown state
-          cur_state->segment_teardown = ACTIVE_CLOSE;
+          ctcp_set_teardown(cur_state, ACTIVE_CLOSE);
 
           continue;
         }
-        // FIN segment timeout
-        if(cur_state->segment_teardown == ACTIVE_CLOSE || cur_state->segment_teardown == PASSIVE_CLOSE) 
+        // FIN segment timeout, when it was not queued behind the data
+        if((cur_state->segment_teardown == ACTIVE_CLOSE || cur_state->segment_teardown == CLOSING) && ! ctcp_fin_queued(cur_state))
         {
           // Retransmit FIN segment
           ctcp_send_flags(cur_state, cur_state->conn_state.last_ackno, FIN);
         }
-        else if(cur_state->segment_teardown == NO_CLOSE)
+        else
         {
+          // Do not time the retransmitted segments, and slow down as the segments were probably lost to congestion, unless the other host's window was just being probed
+          cur_state->rtt_state.rtt_pending = false;
+          if(cur_state->conn_state.next_seqno != cur_state->conn_state.seqno)
+            ctcp_close_cwnd(cur_state);
+          TRACE(TRACE_RETRANSMIT, conn_id(cur_state->conn), cur_state->conn_state.seqno, cur_state->conn_state.next_seqno - cur_state->conn_state.seqno, ll_length(cur_state->tx_state), 0);
           // Retrnasmit all the unacked data segment + new data segment of the sliding window
-          ctcp_send_possible_data_segment(cur_state);
+          ctcp_send_possible_data_segment(cur_state, true);
         }
       }
     }
     else 
     {
       // Send the left data segments
-      ctcp_send_possible_data_segment(cur_state);
+      ctcp_send_possible_data_segment(cur_state, false);
       // Send out of received data segment to STDOUT
-      if(cur_state->rx_state->length > 0)
+      if(ctcp_output_pending(cur_state))
       {
         ctcp_output(cur_state);
+        // Both FINs may have been waiting on the output
+        if(ctcp_try_close(cur_state))
+          continue;
       }
     }
-    cur_state = cur_state->next;
+    // Tell the other host once the receiving rate lets it send again
+    if(cur_state->rate_state != NULL && cur_state->rate_state->window_closed &&
+       ratelimit_available(&cur_state->rate_state->recv, RATE_RECV) >= MAX_SEG_DATA_SIZE)
+    {
+      cur_state->rate_state->window_closed = false;
+      ctcp_send_flags(cur_state, cur_state->conn_state.ackno, ACK);
+    }
+    // Stop visiting the connection once everything is sent, acknowledged and output
+    if(! cur_state->ack_state.time_out && ll_length(cur_state->tx_state) == 0 && ! ctcp_output_pending(cur_state) &&
+       (cur_state->rate_state == NULL || ! cur_state->rate_state->window_closed))
+      ctcp_set_idle(cur_state);
   }
 }
@@ -53,6 +53,24 @@ typedef struct {
                               will be 1 * MAX_SEG_DATA_SIZE */
   int timer;               /* How often ctcp_timer() is called, in ms */
   int rt_timeout;          /* Retransmission timeout, in ms */
+  int keepalive;           /* Idle time before probing the other host, in
+                              ms. 0 to never probe */
+  int keepalive_interval;  /* Time between unanswered probes, in ms */
+  int keepalive_probes;    /* Unanswered probes before giving up */
+  int idle_timeout;        /* Idle time before closing the connection, in
+                              ms. 0 to never close */
+  uint16_t initial_window; /* Initial congestion window, in multiples of
+                              MAX_SEG_DATA_SIZE */
+  long srtt;               /* Smoothed round-trip time learned from the
+                              handshake or by earlier connections to the same
+                              host, in us. 0 if unknown */
+  long rttvar;             /* Round-trip time variation to go with srtt, in
+                              us */
+  uint32_t cwnd;           /* Congestion window learned by earlier
+                              connections to the same host, in bytes. 0 if
+                              unknown */
+  uint32_t ssthresh;       /* Slow start threshold to go with cwnd, in bytes.
+                              0 if unknown */
 } ctcp_config_t;
 
 
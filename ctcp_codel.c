@@ -0,0 +1,64 @@
+#include "ctcp_codel.h"
+#include "ctcp_utils.h"
+
+bool codel_enabled = false;
+
+/** Settings, in ms. */
+static long codel_target;
+static long codel_interval;
+
+/**
+ * Integer square root, rounded down.
+ */
+static uint32_t codel_sqrt(uint32_t n) {
+  uint32_t root = 0;
+  while ((root + 1) * (root + 1) <= n)
+    root++;
+  return root;
+}
+
+/**
+ * Stops holding back input.
+ */
+static void codel_release(codel_t *codel, long now) {
+  codel->first_above = 0;
+  if (codel->holding) {
+    codel->holding = false;
+    codel->last_hold = now;
+  }
+}
+
+void codel_init(int target, int interval) {
+  codel_target = target;
+  codel_interval = interval > 0 ? interval : CODEL_INTERVAL;
+  codel_enabled = true;
+}
+
+bool codel_dequeue(codel_t *codel, long sojourn, long now) {
+  if (sojourn < codel_target) {
+    codel_release(codel, now);
+    return false;
+  }
+  if (codel->holding)
+    return true;
+
+  /* Above the target. Give it an interval to go back down, or less if input
+     was held back a short while ago. */
+  if (codel->first_above == 0) {
+    if (now - codel->last_hold > 16 * codel_interval)
+      codel->count = 0;
+    codel->first_above = now + codel_interval / codel_sqrt(codel->count + 1);
+    return false;
+  }
+  if (now < codel->first_above)
+    return false;
+
+  codel->holding = true;
+  codel->count++;
+  codel->last_hold = now;
+  return true;
+}
+
+void codel_empty(codel_t *codel) {
+  codel_release(codel, current_time());
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ * ctcp_codel.h
+ * ------------
+ * Queue delay control for input waiting to be sent, after CoDel. Input is
+ * read as fast as the program or STDIN gives it, so without a limit it can
+ * sit in the send buffer for a long time behind earlier data, and anything
+ * urgent written after it waits just as long.
+ *
+ * The time each segment waited before it was first sent is measured. Short
+ * bursts above the target are let through, but once the delay stayed above
+ * it for a whole interval, no more input is read until the queue is below the
+ * target again. The window stays full from what is queued, so the throughput
+ * does not suffer. If the delay comes back soon, input is held back sooner,
+ * after interval / sqrt(count) like CoDel's drops.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_CODEL_H
+#define CTCP_CODEL_H
+
+#include "ctcp.h"
+
+/** Delay that input may wait before being sent, in ms, when none is given. */
+#define CODEL_TARGET 5
+
+/** Time the delay may stay above the target, in ms, when none is given. */
+#define CODEL_INTERVAL 100
+
+/** Controller state. Embed one in the connection. */
+typedef struct codel {
+  long first_above;  /* Time input is held back unless the delay goes below
+                        the target first, in ms, 0 if below the target */
+  long last_hold;    /* Time input was last held back, in ms */
+  uint32_t count;    /* Times input was held back in a row */
+  bool holding;      /* Whether or not input is being held back */
+} codel_t;
+
+/** Whether or not the delay is controlled. */
+extern bool codel_enabled;
+
+/**
+ * Turns on delay control.
+ *
+ * target: Delay that input may wait before being sent, in ms.
+ * interval: Time the delay may stay above the target, in ms.
+ */
+void codel_init(int target, int interval);
+
+/**
+ * Takes the delay of a segment sent for the first time.
+ *
+ * codel: The connection's controller.
+ * sojourn: Time the segment waited to be sent, in ms.
+ * now: The current time, in ms.
+ * returns: Whether or not input should be held back.
+ */
+bool codel_dequeue(codel_t *codel, long sojourn, long now);
+
+/**
+ * Called when everything queued was sent. Input is read again.
+ *
+ * codel: The connection's controller.
+ */
+void codel_empty(codel_t *codel);
+
+#endif /* CTCP_CODEL_H */
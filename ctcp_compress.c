@@ -0,0 +1,346 @@
+#include <errno.h>
+
+#include "ctcp_compress.h"
+
+/** Bits of the hash of 4 bytes used to find matches. */
+#define COMPRESS_HASH_BITS 14
+
+/** Shortest match, in bytes. */
+#define COMPRESS_MIN_MATCH 4
+
+/** Size of the history kept by both ends, and the block after it. */
+#define COMPRESS_HIST (COMPRESS_WINDOW + COMPRESS_BLOCK)
+
+struct compress {
+  /* Sending. */
+  char in[COMPRESS_HIST];      /* Input, the block last read at the end */
+  size_t in_len;
+  uint32_t table[1 << COMPRESS_HASH_BITS];  /* Last position in in of each
+                                               hash, plus one, 0 if none */
+  char frame[sizeof(compress_hdr_t) + COMPRESS_BLOCK];  /* Frame being sent */
+  size_t frame_start;          /* Start of what is left in frame */
+  size_t frame_end;            /* End of what is left in frame */
+  bool eof;                    /* Whether or not the input ended */
+  uint64_t raw_bytes;          /* Input read */
+  uint64_t sent_bytes;         /* Frames returned */
+
+  /* Receiving. */
+  compress_hdr_t hdr;          /* Header of the frame coming in */
+  size_t hdr_have;
+  char data[COMPRESS_BLOCK];   /* Data of the frame coming in */
+  size_t data_have;
+  char out[COMPRESS_HIST];     /* Output, the block last decompressed at the
+                                  end */
+  size_t out_len;
+};
+
+bool compress_enabled = false;
+
+uint16_t compress_build(compress_opt_t *opt) {
+  opt->kind = COMPRESS_KIND;
+  opt->len = COMPRESS_OPT_LEN;
+  opt->method = COMPRESS_LZ;
+  return opt->len;
+}
+
+bool compress_parse(const char *payload, size_t len) {
+  compress_opt_t opt;
+  if (len < COMPRESS_OPT_LEN)
+    return false;
+
+  memcpy(&opt, payload, COMPRESS_OPT_LEN);
+  return opt.kind == COMPRESS_KIND && opt.len == COMPRESS_OPT_LEN &&
+         opt.method == COMPRESS_LZ;
+}
+
+compress_t *compress_new() {
+  return calloc(sizeof(compress_t), 1);
+}
+
+/**
+ * Reads 4 bytes, in whatever order the host has them.
+ */
+static uint32_t read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/**
+ * Hashes the 4 bytes at a position.
+ */
+static uint32_t lz_hash(const char *p) {
+  return (read32(p) * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/**
+ * Writes a length that does not fit in its half of the token, 255 at a time.
+ *
+ * returns: The position after it.
+ */
+static size_t lz_put_len(uint8_t *dst, size_t op, size_t len) {
+  for (; len >= 255; len -= 255)
+    dst[op++] = 255;
+  dst[op++] = len;
+  return op;
+}
+
+/**
+ * Writes a sequence: literals, and then a match unless it is the last one.
+ *
+ * returns: The position after it, or 0 if it does not fit in cap bytes.
+ */
+static size_t lz_put_seq(uint8_t *dst, size_t op, size_t cap, const char *lit,
+                         size_t lit_len, size_t dist, size_t match_len) {
+  size_t m = match_len > 0 ? match_len - COMPRESS_MIN_MATCH : 0;
+  if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + m / 255 + 1 > cap)
+    return 0;
+
+  uint8_t *token = &dst[op++];
+  *token = (lit_len < 15 ? lit_len : 15) << 4;
+  if (lit_len >= 15)
+    op = lz_put_len(dst, op, lit_len - 15);
+  memcpy(dst + op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0)
+    return op;
+
+  dst[op++] = dist & 0xff;
+  dst[op++] = dist >> 8;
+  *token |= m < 15 ? m : 15;
+  if (m >= 15)
+    op = lz_put_len(dst, op, m - 15);
+  return op;
+}
+
+/**
+ * Compresses the block at the end of the input, from start to in_len.
+ *
+ * returns: The length of the data, or 0 if it would not be smaller than the
+ *          block.
+ */
+static size_t lz_compress(compress_t *c, size_t start, uint8_t *dst) {
+  size_t cap = c->in_len - start;
+  size_t ip = start, anchor = start, op = 0;
+
+  while (ip + COMPRESS_MIN_MATCH <= c->in_len) {
+    uint32_t h = lz_hash(c->in + ip);
+    size_t ref = c->table[h];
+    c->table[h] = ip + 1;
+
+    if (ref == 0 || ip - (ref - 1) > 0xffff ||
+        read32(c->in + ref - 1) != read32(c->in + ip)) {
+      /* Move faster over input that does not match. */
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    ref--;
+
+    size_t len = COMPRESS_MIN_MATCH;
+    while (ip + len < c->in_len && c->in[ref + len] == c->in[ip + len])
+      len++;
+    op = lz_put_seq(dst, op, cap, c->in + anchor, ip - anchor, ip - ref, len);
+    if (op == 0)
+      return 0;
+    ip += len;
+    anchor = ip;
+
+    /* The end of a match often starts the next one. */
+    if (ip + COMPRESS_MIN_MATCH <= c->in_len)
+      c->table[lz_hash(c->in + ip - 2)] = ip - 2 + 1;
+  }
+
+  op = lz_put_seq(dst, op, cap, c->in + anchor, c->in_len - anchor, 0, 0);
+  return op < cap ? op : 0;
+}
+
+/**
+ * Reads the next block and compresses it into a frame.
+ *
+ * returns: 1 if there is a frame, 0 if there is no input now, or -1 if the
+ *          input ended.
+ */
+static int compress_frame(compress_t *c, int fd) {
+  compress_hdr_t *hdr = (compress_hdr_t *) c->frame;
+
+  /* Keep only the window before the next block. Positions in the hash
+     table move with it. */
+  if (c->in_len > COMPRESS_WINDOW) {
+    size_t shift = c->in_len - COMPRESS_WINDOW;
+    int i;
+    memmove(c->in, c->in + shift, COMPRESS_WINDOW);
+    c->in_len = COMPRESS_WINDOW;
+    for (i = 0; i < 1 << COMPRESS_HASH_BITS; i++)
+      c->table[i] = c->table[i] > shift ? c->table[i] - shift : 0;
+  }
+
+  int r = read(fd, c->in + c->in_len, COMPRESS_BLOCK);
+  if (r < 0 && errno == EAGAIN)
+    return 0;
+  if (r <= 0) {
+    c->eof = true;
+    return -1;
+  }
+
+  size_t start = c->in_len;
+  c->in_len += r;
+  size_t len = lz_compress(c, start, (uint8_t *) (hdr + 1));
+  if (len == 0) {
+    memcpy(hdr + 1, c->in + start, r);
+    len = r;
+  }
+  hdr->method = len < (size_t) r ? COMPRESS_LZ : 0;
+  hdr->raw_len = htons(r);
+  hdr->len = htons(len);
+
+  c->frame_start = 0;
+  c->frame_end = sizeof(compress_hdr_t) + len;
+  c->raw_bytes += r;
+  return 1;
+}
+
+int compress_input(compress_t *c, int fd, char *buf, size_t len) {
+  size_t n = 0;
+
+  /* Fill the buffer, going on into the next frame if there is input. */
+  while (n < len) {
+    if (c->frame_start == c->frame_end &&
+        (c->eof || compress_frame(c, fd) <= 0))
+      break;
+
+    size_t take = c->frame_end - c->frame_start;
+    take = take < len - n ? take : len - n;
+    memcpy(buf + n, c->frame + c->frame_start, take);
+    c->frame_start += take;
+    n += take;
+  }
+
+  c->sent_bytes += n;
+  if (n == 0 && c->eof)
+    return -1;
+  return n;
+}
+
+bool compress_held(compress_t *c) {
+  return c->frame_start < c->frame_end;
+}
+
+/**
+ * Decompresses a frame into the output, after the window.
+ *
+ * returns: 0 on success, -1 if it is not valid.
+ */
+static int lz_decompress(compress_t *c, const uint8_t *src, size_t len,
+                         size_t raw_len) {
+  size_t ip = 0, op = c->out_len, end = c->out_len + raw_len;
+
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    size_t lit_len = token >> 4;
+    uint8_t b = 255;
+    if (lit_len == 15) {
+      while (b == 255 && ip < len)
+        lit_len += (b = src[ip++]);
+    }
+    if (ip + lit_len > len || op + lit_len > end)
+      return -1;
+    memcpy(c->out + op, src + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    /* The last sequence has no match. */
+    if (ip == len)
+      break;
+    if (ip + 2 > len)
+      return -1;
+    size_t dist = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+
+    size_t match_len = (token & 15) + COMPRESS_MIN_MATCH;
+    b = 255;
+    if ((token & 15) == 15) {
+      while (b == 255 && ip < len)
+        match_len += (b = src[ip++]);
+    }
+    if (dist == 0 || dist > op || op + match_len > end)
+      return -1;
+
+    /* Byte by byte, the match may run into what it copies. */
+    const char *ref = c->out + op - dist;
+    char *dst = c->out + op;
+    size_t i;
+    if (dist >= match_len)
+      memcpy(dst, ref, match_len);
+    else
+      for (i = 0; i < match_len; i++)
+        dst[i] = ref[i];
+    op += match_len;
+  }
+  return op == end ? 0 : -1;
+}
+
+int compress_output(compress_t *c, const char *buf, size_t len,
+                    const char **out, size_t *out_len) {
+  size_t n = 0;
+  *out = NULL;
+
+  /* The header first. */
+  if (c->hdr_have < sizeof(compress_hdr_t)) {
+    n = sizeof(compress_hdr_t) - c->hdr_have;
+    n = n < len ? n : len;
+    memcpy((char *) &c->hdr + c->hdr_have, buf, n);
+    c->hdr_have += n;
+    if (c->hdr_have < sizeof(compress_hdr_t))
+      return n;
+
+    size_t raw_len = ntohs(c->hdr.raw_len);
+    size_t data_len = ntohs(c->hdr.len);
+    if (raw_len == 0 || raw_len > COMPRESS_BLOCK ||
+        (c->hdr.method == 0 && data_len != raw_len) ||
+        (c->hdr.method != 0 && c->hdr.method != COMPRESS_LZ) ||
+        data_len == 0 || data_len > COMPRESS_BLOCK)
+      return -1;
+  }
+
+  /* Then the data. */
+  size_t data_len = ntohs(c->hdr.len);
+  size_t take = data_len - c->data_have;
+  take = take < len - n ? take : len - n;
+  memcpy(c->data + c->data_have, buf + n, take);
+  c->data_have += take;
+  n += take;
+  if (c->data_have < data_len)
+    return n;
+
+  /* Keep only the window before the block. */
+  size_t raw_len = ntohs(c->hdr.raw_len);
+  if (c->out_len + raw_len > COMPRESS_HIST) {
+    size_t shift = c->out_len - COMPRESS_WINDOW;
+    memmove(c->out, c->out + shift, COMPRESS_WINDOW);
+    c->out_len = COMPRESS_WINDOW;
+  }
+
+  if (c->hdr.method == 0)
+    memcpy(c->out + c->out_len, c->data, raw_len);
+  else if (lz_decompress(c, (uint8_t *) c->data, data_len, raw_len) < 0)
+    return -1;
+
+  *out = c->out + c->out_len;
+  *out_len = raw_len;
+  c->out_len += raw_len;
+  c->hdr_have = 0;
+  c->data_have = 0;
+  return n;
+}
+
+bool compress_pending(compress_t *c) {
+  return c->hdr_have > 0;
+}
+
+void compress_free(compress_t *c) {
+  if (c->raw_bytes > 0)
+    fprintf(stderr, "[INFO] Compressed %llu bytes of input into %llu\n",
+            (unsigned long long) c->raw_bytes,
+            (unsigned long long) c->sent_bytes);
+  free(c);
+}
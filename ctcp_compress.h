@@ -0,0 +1,139 @@
+/******************************************************************************
+ * ctcp_compress.h
+ * ---------------
+ * Compression of the data of a connection, both ways. Input is read in blocks
+ * of up to COMPRESS_BLOCK bytes, and each block is compressed into a frame
+ * before being cut into segments:
+ *
+ *   method (1) | raw length (2) | length (2) | data
+ *
+ * with the lengths in network order. The data is LZ77 sequences, each a
+ * token holding the number of literals and the length of the match that
+ * follows them, the literals, and the distance back to the match:
+ *
+ *   token (1) | [more literals] | literals | distance (2) | [more length]
+ *
+ * Matches may reach back COMPRESS_WINDOW bytes before the block, into earlier
+ * blocks, so repeated lines compress even when they are far apart. A block
+ * that does not get smaller is sent as it is. The receiver decompresses each
+ * frame as soon as all of it came in, before it is output.
+ *
+ * Both hosts have to agree. The client asks in a small block in the payload
+ * of its SYN, laid out like a TCP option, and the server agrees by answering
+ * with the same block in its SYN-ACK. A host that does not know about it
+ * ignores the block, and the connection is not compressed.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_COMPRESS_H
+#define CTCP_COMPRESS_H
+
+#include "ctcp_sys.h"
+
+/** Option kind of the compression block (experimental TCP option). */
+#define COMPRESS_KIND 253
+
+/** Length of the block. */
+#define COMPRESS_OPT_LEN 3
+
+/** The only method there is: the LZ77 sequences above. */
+#define COMPRESS_LZ 1
+
+/** Largest block of input compressed at once, in bytes. */
+#define COMPRESS_BLOCK (16 * 1024)
+
+/** How far back matches may reach before a block, in bytes. */
+#define COMPRESS_WINDOW (32 * 1024)
+
+/** Compression block at the start of a SYN or SYN-ACK payload. */
+typedef struct compress_opt {
+  uint8_t kind;       /* COMPRESS_KIND */
+  uint8_t len;        /* COMPRESS_OPT_LEN */
+  uint8_t method;     /* COMPRESS_LZ */
+} __attribute__((packed)) compress_opt_t;
+
+/** Start of every frame. */
+typedef struct compress_hdr {
+  uint8_t method;     /* COMPRESS_LZ, or 0 if sent as it is */
+  uint16_t raw_len;   /* Length of the block */
+  uint16_t len;       /* Length of the data that follows */
+} __attribute__((packed)) compress_hdr_t;
+
+/** Compression of a connection, both ways. */
+typedef struct compress compress_t;
+
+/** Whether or not connections ask for (or agree to) compression. */
+extern bool compress_enabled;
+
+/**
+ * Fills in a compression block.
+ *
+ * opt: The block to fill in.
+ * returns: Length of the block.
+ */
+uint16_t compress_build(compress_opt_t *opt);
+
+/**
+ * Looks for a compression block at the start of a SYN or SYN-ACK payload.
+ *
+ * payload: The payload.
+ * len: Length of the payload.
+ * returns: Whether or not there is one, with a method we know.
+ */
+bool compress_parse(const char *payload, size_t len);
+
+/**
+ * Starts compression for a connection that agreed to it.
+ *
+ * returns: Its compression.
+ */
+compress_t *compress_new();
+
+/**
+ * Reads input and returns the next frames, or part of them, to send.
+ *
+ * c: The connection's compression.
+ * fd: Where the input is read from.
+ * buf: Buffer for the frames.
+ * len: Size of the buffer.
+ * returns: The number of bytes in the buffer, 0 if there is no input now, or
+ *          -1 once the input ended and everything was returned.
+ */
+int compress_input(compress_t *c, int fd, char *buf, size_t len);
+
+/**
+ * Returns whether or not input was compressed and not returned yet.
+ *
+ * c: The connection's compression.
+ */
+bool compress_held(compress_t *c);
+
+/**
+ * Takes frames received, up to the end of the next frame.
+ *
+ * c: The connection's compression.
+ * buf: The frames.
+ * len: Length of the frames.
+ * out: Return parameter. The block decompressed from the frame that was
+ *      completed, or NULL if none was. Only valid until the next call.
+ * out_len: Return parameter. Length of the block.
+ * returns: The number of bytes taken, or -1 if a frame is not valid.
+ */
+int compress_output(compress_t *c, const char *buf, size_t len,
+                    const char **out, size_t *out_len);
+
+/**
+ * Returns whether or not part of a frame was received and not output.
+ *
+ * c: The connection's compression.
+ */
+bool compress_pending(compress_t *c);
+
+/**
+ * Frees a connection's compression.
+ *
+ * c: The connection's compression.
+ */
+void compress_free(compress_t *c);
+
+#endif /* CTCP_COMPRESS_H */
@@ -0,0 +1,152 @@
+#include "ctcp_fastopen.h"
+#include "ctcp_utils.h"
+
+/** Maximum number of servers kept in the cookie cache. */
+#define FASTOPEN_CACHE_SIZE 64
+
+/** A line of the cookie cache. */
+typedef struct fastopen_entry {
+  in_addr_t ip_addr;
+  int port;
+  uint8_t cookie[FASTOPEN_COOKIE_LEN];
+} fastopen_entry_t;
+
+bool fastopen_enabled = false;
+
+static const char *cache_file;
+static uint64_t secret[2];
+
+/**
+ * Reads the cookie cache. Lines that cannot be parsed are skipped.
+ *
+ * entries: Return parameter. Array of FASTOPEN_CACHE_SIZE entries.
+ * returns: Number of entries read.
+ */
+static int fastopen_cache_read(fastopen_entry_t *entries) {
+  FILE *f = fopen(cache_file, "r");
+  if (f == NULL)
+    return 0;
+
+  int n = 0, i;
+  unsigned int ip_addr;
+  char hex[2 * FASTOPEN_COOKIE_LEN + 1];
+  while (n < FASTOPEN_CACHE_SIZE &&
+         fscanf(f, "%x %d %16s", &ip_addr, &entries[n].port, hex) == 3) {
+    if (strlen(hex) != 2 * FASTOPEN_COOKIE_LEN)
+      continue;
+    for (i = 0; i < FASTOPEN_COOKIE_LEN; i++) {
+      unsigned int byte;
+      sscanf(hex + 2 * i, "%2x", &byte);
+      entries[n].cookie[i] = byte;
+    }
+    entries[n].ip_addr = ip_addr;
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+int fastopen_init(const char *file) {
+  cache_file = file;
+
+  /* Server. Make up a secret for this run. */
+  if (file == NULL && random_bytes(secret, sizeof(secret)) < 0) {
+    fprintf(stderr, "[ERROR] Could not make a fast-open secret\n");
+    return -1;
+  }
+
+  fastopen_enabled = true;
+  return 0;
+}
+
+void fastopen_cookie(in_addr_t ip_addr, uint8_t *cookie) {
+  /* Not a MAC, but the secret cannot be recovered from the cookies of other
+     addresses without a lot of effort, which is enough here. */
+  uint64_t value = mix64(mix64(secret[0] ^ ip_addr) ^ secret[1]);
+  memcpy(cookie, &value, FASTOPEN_COOKIE_LEN);
+}
+
+bool fastopen_check(in_addr_t ip_addr, const uint8_t *cookie) {
+  uint8_t expected[FASTOPEN_COOKIE_LEN];
+  fastopen_cookie(ip_addr, expected);
+  return memcmp(cookie, expected, FASTOPEN_COOKIE_LEN) == 0;
+}
+
+uint16_t fastopen_build(fastopen_opt_t *opt, const uint8_t *cookie) {
+  opt->kind = FASTOPEN_KIND;
+  if (cookie == NULL) {
+    opt->len = FASTOPEN_REQUEST_LEN;
+  }
+  else {
+    opt->len = FASTOPEN_OPT_LEN;
+    memcpy(opt->cookie, cookie, FASTOPEN_COOKIE_LEN);
+  }
+  return opt->len;
+}
+
+uint16_t fastopen_parse(const char *payload, size_t len, fastopen_opt_t *opt) {
+  if (len < FASTOPEN_REQUEST_LEN)
+    return 0;
+
+  memcpy(opt, payload, FASTOPEN_REQUEST_LEN);
+  if (opt->kind != FASTOPEN_KIND)
+    return 0;
+  if (opt->len == FASTOPEN_REQUEST_LEN)
+    return opt->len;
+  if (opt->len != FASTOPEN_OPT_LEN || len < FASTOPEN_OPT_LEN)
+    return 0;
+
+  memcpy(opt->cookie, payload + FASTOPEN_REQUEST_LEN, FASTOPEN_COOKIE_LEN);
+  return opt->len;
+}
+
+bool fastopen_cache_get(in_addr_t ip_addr, int port, uint8_t *cookie) {
+  fastopen_entry_t entries[FASTOPEN_CACHE_SIZE];
+  int n = fastopen_cache_read(entries);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    if (entries[i].ip_addr == ip_addr && entries[i].port == port) {
+      memcpy(cookie, entries[i].cookie, FASTOPEN_COOKIE_LEN);
+      return true;
+    }
+  }
+  return false;
+}
+
+void fastopen_cache_put(in_addr_t ip_addr, int port, const uint8_t *cookie) {
+  fastopen_entry_t entries[FASTOPEN_CACHE_SIZE];
+  int n = fastopen_cache_read(entries);
+
+  /* Replace the server's entry, or add one (dropping the oldest if full). */
+  int i;
+  for (i = 0; i < n; i++) {
+    if (entries[i].ip_addr == ip_addr && entries[i].port == port)
+      break;
+  }
+  if (i == FASTOPEN_CACHE_SIZE) {
+    memmove(entries, entries + 1, (n - 1) * sizeof(fastopen_entry_t));
+    i = n - 1;
+  }
+  else if (i == n) {
+    n++;
+  }
+  entries[i].ip_addr = ip_addr;
+  entries[i].port = port;
+  memcpy(entries[i].cookie, cookie, FASTOPEN_COOKIE_LEN);
+
+  FILE *f = fopen(cache_file, "w");
+  if (f == NULL) {
+    fprintf(stderr, "[ERROR] Could not write fast-open cookies to %s\n",
+            cache_file);
+    return;
+  }
+  int j;
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%x %d ", (unsigned int) entries[i].ip_addr, entries[i].port);
+    for (j = 0; j < FASTOPEN_COOKIE_LEN; j++)
+      fprintf(f, "%02x", entries[i].cookie[j]);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
@@ -0,0 +1,114 @@
+/******************************************************************************
+ * ctcp_fastopen.h
+ * ---------------
+ * Fast open: a client sends its first data together with the SYN, and the
+ * server hands it to the program straight away instead of after the
+ * handshake. The data is only accepted if the SYN carries a cookie the server
+ * gave out on an earlier connection, so the server does not act on data from
+ * a client whose address it has not seen reply.
+ *
+ * There are no TCP options in cTCP, so the cookie (or a request for one)
+ * travels in a small block at the start of the SYN and SYN-ACK payloads,
+ * laid out like the TCP Fast Open option. Clients keep the cookies they got
+ * in a cache file, one line per server.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_FASTOPEN_H
+#define CTCP_FASTOPEN_H
+
+#include "ctcp_sys.h"
+
+/** Option kind of the fast-open block (same as TCP Fast Open). */
+#define FASTOPEN_KIND 34
+
+/** Length of a cookie, in bytes. */
+#define FASTOPEN_COOKIE_LEN 8
+
+/** Length of the block when requesting a cookie and when carrying one. */
+#define FASTOPEN_REQUEST_LEN 2
+#define FASTOPEN_OPT_LEN (2 + FASTOPEN_COOKIE_LEN)
+
+/** Cookie cache used by clients if no file is given. */
+#define FASTOPEN_DEFAULT_CACHE ".ctcp_fastopen"
+
+/** Fast-open block at the start of a SYN or SYN-ACK payload. */
+typedef struct fastopen_opt {
+  uint8_t kind;                         /* FASTOPEN_KIND */
+  uint8_t len;                          /* Length of the block */
+  uint8_t cookie[FASTOPEN_COOKIE_LEN];  /* Only if len is FASTOPEN_OPT_LEN */
+} __attribute__((packed)) fastopen_opt_t;
+
+/** Whether or not fast open is turned on. */
+extern bool fastopen_enabled;
+
+/**
+ * Turns on fast open. A server makes up the secret its cookies are derived
+ * from; a client uses the given cookie cache.
+ *
+ * cache_file: The client's cookie cache, NULL for a server.
+ * returns: 0 on success, -1 if the secret could not be made.
+ */
+int fastopen_init(const char *cache_file);
+
+/**
+ * [Server only]
+ * Computes the cookie of a client. Cookies only stay valid while the server
+ * runs.
+ *
+ * ip_addr: IP address of the client.
+ * cookie: Return parameter. Buffer of FASTOPEN_COOKIE_LEN bytes.
+ */
+void fastopen_cookie(in_addr_t ip_addr, uint8_t *cookie);
+
+/**
+ * [Server only]
+ * Checks the cookie a client sent with its SYN.
+ *
+ * ip_addr: IP address of the client.
+ * cookie: The cookie received.
+ * returns: Whether or not the cookie is valid.
+ */
+bool fastopen_check(in_addr_t ip_addr, const uint8_t *cookie);
+
+/**
+ * Fills in a fast-open block.
+ *
+ * opt: The block to fill in.
+ * cookie: The cookie to send, or NULL to ask for one.
+ * returns: Length of the block.
+ */
+uint16_t fastopen_build(fastopen_opt_t *opt, const uint8_t *cookie);
+
+/**
+ * Looks for a fast-open block at the start of a SYN or SYN-ACK payload.
+ *
+ * payload: The payload.
+ * len: Length of the payload.
+ * opt: Return parameter. The block found.
+ * returns: Length of the block, 0 if there is none.
+ */
+uint16_t fastopen_parse(const char *payload, size_t len, fastopen_opt_t *opt);
+
+/**
+ * [Client only]
+ * Looks up the cookie of a server in the cache.
+ *
+ * ip_addr: IP address of the server.
+ * port: Port of the server.
+ * cookie: Return parameter. Buffer of FASTOPEN_COOKIE_LEN bytes.
+ * returns: Whether or not there is a cookie for the server.
+ */
+bool fastopen_cache_get(in_addr_t ip_addr, int port, uint8_t *cookie);
+
+/**
+ * [Client only]
+ * Stores the cookie of a server in the cache, replacing the old one.
+ *
+ * ip_addr: IP address of the server.
+ * port: Port of the server.
+ * cookie: The cookie received.
+ */
+void fastopen_cache_put(in_addr_t ip_addr, int port, const uint8_t *cookie);
+
+#endif /* CTCP_FASTOPEN_H */
@@ -132,13 +132,13 @@ ll_node_t *ll_find(linked_list_t *list, void *object) {
 }
 
 ll_node_t *ll_front(linked_list_t *list) {
-  return list->head;
+  return list == NULL ? NULL : list->head;
 }
 
 ll_node_t *ll_back(linked_list_t *list) {
-  return list->tail;
+  return list == NULL ? NULL : list->tail;
 }
 
 unsigned int ll_length(linked_list_t *list) {
-  return list->length;
+  return list == NULL ? 0 : list->length;
 }
@@ -106,17 +106,17 @@ void *ll_remove(linked_list_t *list, ll_node_t *node);
 ll_node_t *ll_find(linked_list_t *list, void *object);
 
 /**
- * Returns the first element in the list.
+ * Returns the first element in the list. A NULL list is empty.
  */
 ll_node_t *ll_front(linked_list_t *list);
 
 /**
- * Returns the last element in the list.
+ * Returns the last element in the list. A NULL list is empty.
  */
 ll_node_t *ll_back(linked_list_t *list);
 
 /**
- * Returns the length of the list.
+ * Returns the length of the list. A NULL list is empty.
  */
 unsigned int ll_length(linked_list_t *list);
 
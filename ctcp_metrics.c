@@ -0,0 +1,51 @@
+#include "ctcp_metrics.h"
+#include "ctcp_utils.h"
+
+/** A host in the cache. */
+typedef struct metrics_entry {
+  in_addr_t ip_addr;
+  long stamp;          /* When it was stored, in ms, 0 if unused */
+  metrics_t metrics;
+} metrics_entry_t;
+
+bool metrics_enabled = false;
+
+static metrics_entry_t entries[METRICS_CACHE_SIZE];
+
+/**
+ * Finds the slot of a host. Hosts are hashed into the table, and a host
+ * replaces whatever was in its slot.
+ */
+static metrics_entry_t *metrics_slot(in_addr_t ip_addr) {
+  uint32_t h = ntohl(ip_addr) * 2654435761u;
+  return &entries[h % METRICS_CACHE_SIZE];
+}
+
+void metrics_init() {
+  memset(entries, 0, sizeof(entries));
+  metrics_enabled = true;
+}
+
+bool metrics_get(in_addr_t ip_addr, metrics_t *metrics) {
+  metrics_entry_t *entry = metrics_slot(ip_addr);
+  if (!metrics_enabled || entry->stamp == 0 || entry->ip_addr != ip_addr)
+    return false;
+
+  /* Forget entries that are too old. */
+  if (current_time() - entry->stamp > METRICS_TTL * 1000L) {
+    entry->stamp = 0;
+    return false;
+  }
+  *metrics = entry->metrics;
+  return true;
+}
+
+void metrics_put(in_addr_t ip_addr, const metrics_t *metrics) {
+  if (!metrics_enabled)
+    return;
+
+  metrics_entry_t *entry = metrics_slot(ip_addr);
+  entry->ip_addr = ip_addr;
+  entry->stamp = current_time();
+  entry->metrics = *metrics;
+}
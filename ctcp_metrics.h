@@ -0,0 +1,59 @@
+/******************************************************************************
+ * ctcp_metrics.h
+ * --------------
+ * Per-destination metrics cache. When a connection ends, what it learned
+ * about the path to the other host is kept, keyed by the host's address, and
+ * handed to the next connection to the same host so it does not have to
+ * learn it again. Entries expire after METRICS_TTL seconds, since paths
+ * change.
+ *
+ * The cache lives in memory, so it helps a server with many clients, or a
+ * client with several connections to the same server.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_METRICS_H
+#define CTCP_METRICS_H
+
+#include "ctcp_sys.h"
+
+/** Number of hosts kept in the cache. */
+#define METRICS_CACHE_SIZE 64
+
+/** Time an entry is kept, in seconds. */
+#define METRICS_TTL 600
+
+/** What is known about the path to a host. */
+typedef struct metrics {
+  long srtt;         /* Smoothed round-trip time, in us */
+  long rttvar;       /* Round-trip time variation, in us */
+  uint32_t cwnd;     /* Congestion window, in bytes */
+  uint32_t ssthresh; /* Slow start threshold, in bytes, 0 if unknown */
+} metrics_t;
+
+/** Whether or not the cache is turned on. */
+extern bool metrics_enabled;
+
+/**
+ * Turns on the cache.
+ */
+void metrics_init();
+
+/**
+ * Looks up what is known about a host.
+ *
+ * ip_addr: IP address of the host.
+ * metrics: Return parameter. The metrics found.
+ * returns: Whether or not there is an entry for the host.
+ */
+bool metrics_get(in_addr_t ip_addr, metrics_t *metrics);
+
+/**
+ * Stores what a connection learned about a host, replacing the old entry.
+ *
+ * ip_addr: IP address of the host.
+ * metrics: The metrics to keep.
+ */
+void metrics_put(in_addr_t ip_addr, const metrics_t *metrics);
+
+#endif /* CTCP_METRICS_H */
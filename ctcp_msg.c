@@ -0,0 +1,191 @@
+#include <errno.h>
+
+#include "ctcp_msg.h"
+
+struct msg {
+  /* Sending. */
+  char in[MSG_STAGING];        /* Input read but not sent yet */
+  size_t in_start;             /* Start of what is left in in */
+  size_t in_end;               /* End of what is left in in */
+  size_t span_left;            /* Bytes left of a record too large for one
+                                  segment, 0 if none */
+  bool eof;                    /* Whether or not the input ended */
+
+  /* Receiving. */
+  char hdr[MSG_HDR_SIZE];      /* Length of the record coming in */
+  char *out;                   /* Record coming in, length first */
+  size_t out_have;             /* Bytes of it received */
+  size_t out_len;              /* Its length, length included, 0 until the
+                                  length came in */
+};
+
+bool msg_enabled = false;
+
+/**
+ * Reads the length of a record.
+ */
+static uint32_t msg_len(const char *hdr) {
+  uint32_t len;
+  memcpy(&len, hdr, MSG_HDR_SIZE);
+  return ntohl(len);
+}
+
+msg_t *msg_new() {
+  return calloc(sizeof(msg_t), 1);
+}
+
+/**
+ * Cuts the next segment from the input read so far.
+ *
+ * returns: The length of the segment, 0 if there is not enough input yet, or
+ *          -1 if the next record is larger than MSG_MAX_SIZE.
+ */
+static int msg_pack(msg_t *msg, char *buf, size_t len) {
+  const char *p = msg->in + msg->in_start;
+  size_t avail = msg->in_end - msg->in_start;
+  size_t used = 0;
+
+  /* The rest of a record too large for one segment. Send it in full
+     segments, and whatever is left at its end. */
+  if (msg->span_left > 0) {
+    size_t n = msg->span_left < len ? msg->span_left : len;
+    if (avail < n)
+      return 0;
+    memcpy(buf, p, n);
+    msg->span_left -= n;
+    msg->in_start += n;
+    return n;
+  }
+
+  /* As many whole records as fit. */
+  while (avail - used >= MSG_HDR_SIZE) {
+    uint32_t data_len = msg_len(p + used);
+    if (data_len > MSG_MAX_SIZE) {
+      if (used > 0)
+        break;
+      return -1;
+    }
+    size_t total = MSG_HDR_SIZE + data_len;
+    if (used + total <= len) {
+      if (avail - used < total)
+        break;
+      used += total;
+      continue;
+    }
+    if (used == 0) {
+      msg->span_left = total;
+      return msg_pack(msg, buf, len);
+    }
+    break;
+  }
+  memcpy(buf, p, used);
+  msg->in_start += used;
+  return used;
+}
+
+int msg_input(msg_t *msg, int fd, char *buf, size_t len) {
+  if (len == 0)
+    return 0;
+
+  while (true) {
+    int r = msg_pack(msg, buf, len);
+    if (r > 0)
+      return r;
+
+    /* The receiver would not take the record. End the input before it. */
+    if (r < 0) {
+      fprintf(stderr, "[ERROR] Record larger than %d bytes, ending the "
+              "input\n", MSG_MAX_SIZE);
+      msg->eof = true;
+      msg->in_start = msg->in_end;
+      return -1;
+    }
+
+    /* The input ended. Send what is left, even if a record was cut short,
+       and then the end. */
+    if (msg->eof) {
+      size_t left = msg->in_end - msg->in_start;
+      if (left == 0)
+        return -1;
+      left = left < len ? left : len;
+      memcpy(buf, msg->in + msg->in_start, left);
+      msg->in_start += left;
+      return left;
+    }
+
+    /* Read more. */
+    memmove(msg->in, msg->in + msg->in_start, msg->in_end - msg->in_start);
+    msg->in_end -= msg->in_start;
+    msg->in_start = 0;
+    r = read(fd, msg->in + msg->in_end, MSG_STAGING - msg->in_end);
+    if (r < 0 && errno == EAGAIN)
+      return 0;
+    if (r <= 0)
+      msg->eof = true;
+    else
+      msg->in_end += r;
+  }
+}
+
+int msg_take(msg_t *msg, const char *buf, size_t len, const char **record,
+             size_t *record_len) {
+  size_t n = 0;
+  *record = NULL;
+
+  /* A whole record, and nothing before it. No need to copy it. */
+  if (msg->out_have == 0 && len >= MSG_HDR_SIZE) {
+    uint32_t data_len = msg_len(buf);
+    if (data_len > MSG_MAX_SIZE)
+      return -1;
+    if (len >= MSG_HDR_SIZE + data_len) {
+      *record = buf;
+      *record_len = MSG_HDR_SIZE + data_len;
+      return *record_len;
+    }
+  }
+
+  /* The length first. */
+  if (msg->out_have < MSG_HDR_SIZE) {
+    n = MSG_HDR_SIZE - msg->out_have;
+    n = n < len ? n : len;
+    memcpy(msg->hdr + msg->out_have, buf, n);
+    msg->out_have += n;
+    if (msg->out_have < MSG_HDR_SIZE)
+      return n;
+
+    uint32_t data_len = msg_len(msg->hdr);
+    if (data_len > MSG_MAX_SIZE)
+      return -1;
+    msg->out_len = MSG_HDR_SIZE + data_len;
+    msg->out = realloc(msg->out, msg->out_len);
+    memcpy(msg->out, msg->hdr, MSG_HDR_SIZE);
+  }
+
+  /* Then the data. */
+  size_t take = msg->out_len - msg->out_have;
+  take = take < len - n ? take : len - n;
+  memcpy(msg->out + msg->out_have, buf + n, take);
+  msg->out_have += take;
+  n += take;
+
+  if (msg->out_have == msg->out_len) {
+    *record = msg->out;
+    *record_len = msg->out_len;
+    msg->out_have = 0;
+    msg->out_len = 0;
+  }
+  return n;
+}
+
+bool msg_held(msg_t *msg) {
+  return msg->in_end > msg->in_start;
+}
+
+bool msg_pending(msg_t *msg) {
+  return msg->out_have > 0;
+}
+
+void msg_free(msg_t *msg) {
+  free(msg->out);
+  free(msg);
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+ * ctcp_msg.h
+ * ----------
+ * Message mode. Input and output are records, each a length in network order
+ * followed by that many bytes:
+ *
+ *   length (4) | data
+ *
+ * The sender cuts the input into segments at record boundaries, packing as
+ * many whole records into each segment as fit. Only records too large for a
+ * segment are spread over several. The receiver collects each record and
+ * writes it out whole, in a single write, so applications never see part of
+ * one.
+ *
+ * The records go over the connection as they are, so a host that is not in
+ * message mode sees the same bytes as a stream.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_MSG_H
+#define CTCP_MSG_H
+
+#include "ctcp.h"
+
+/** Size of the length in front of every record. */
+#define MSG_HDR_SIZE 4
+
+/** Largest record, not counting its length, in bytes. */
+#define MSG_MAX_SIZE (64 * 1024)
+
+/** Input read but not sent yet, in bytes. Holds a segment's worth of records
+    and the start of the next one. */
+#define MSG_STAGING (2 * MAX_SEG_DATA_SIZE)
+
+/** Records being sent and received on a connection. */
+typedef struct msg msg_t;
+
+/** Whether or not connections are in message mode. */
+extern bool msg_enabled;
+
+/**
+ * Starts message mode for a new connection.
+ *
+ * returns: Its records.
+ */
+msg_t *msg_new();
+
+/**
+ * Reads input and returns the next segment of whole records. A record that
+ * is not complete yet is left for later, unless it is too large for one
+ * segment.
+ *
+ * msg: The connection's records.
+ * fd: Where the input is read from.
+ * buf: Buffer for the segment.
+ * len: Size of the buffer.
+ * returns: The length of the segment, 0 if there is none yet, or -1 once the
+ *          input ended and everything was returned. A record larger than
+ *          MSG_MAX_SIZE ends the input.
+ */
+int msg_input(msg_t *msg, int fd, char *buf, size_t len);
+
+/**
+ * Takes output received, up to the end of the next record.
+ *
+ * msg: The connection's records.
+ * buf: The output.
+ * len: Length of the output.
+ * record: Return parameter. The record that was completed, length first, or
+ *         NULL if none was. Only valid until the next call.
+ * record_len: Return parameter. Length of the record, length included.
+ * returns: The number of bytes taken, or -1 if a record is larger than
+ *          MSG_MAX_SIZE.
+ */
+int msg_take(msg_t *msg, const char *buf, size_t len, const char **record,
+             size_t *record_len);
+
+/**
+ * Returns whether or not input was read and not returned yet.
+ *
+ * msg: The connection's records.
+ */
+bool msg_held(msg_t *msg);
+
+/**
+ * Returns whether or not part of a record was received and not output.
+ *
+ * msg: The connection's records.
+ */
+bool msg_pending(msg_t *msg);
+
+/**
+ * Frees a connection's records.
+ *
+ * msg: The connection's records.
+ */
+void msg_free(msg_t *msg);
+
+#endif /* CTCP_MSG_H */
@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+
+#include "ctcp_mux.h"
+
+/** Data of a stream received, waiting for those before it or for room. */
+typedef struct mux_piece {
+  struct mux_piece *next;
+  uint32_t offset;    /* Position in the stream */
+  size_t len;         /* Length of the data */
+  size_t used;        /* Data already output */
+  bool fin;           /* Whether or not the stream ends after it */
+  char data[];
+} mux_piece_t;
+
+/** A stream being sent. */
+typedef struct mux_in {
+  bool open;                   /* Whether or not it was added */
+  bool done;                   /* Whether or not its end was sent */
+  int fd;                      /* Where it is read from */
+  struct pollfd *poll;         /* Used to poll fd, NULL if not polled */
+  uint32_t offset;             /* Position of the next data read */
+} mux_in_t;
+
+/** A stream being received. */
+typedef struct mux_out {
+  bool seen;                   /* Whether or not something came in */
+  bool fin_taken;              /* Whether or not its end came in */
+  uint32_t next;               /* Position of the next data expected */
+  mux_piece_t *ahead;          /* Data after next, in order */
+  mux_piece_t *ready;          /* Data in order, waiting for room */
+  mux_piece_t **ready_tail;
+  size_t held;                 /* Bytes in ahead and ready */
+  int fd;                      /* File it is written to, -1 until opened */
+  bool failed;                 /* Could not be written, data is dropped */
+} mux_out_t;
+
+struct mux {
+  uint32_t conn_id;            /* Number of the connection */
+  mux_in_t in[MUX_MAX_STREAMS];
+  int next_in;                 /* Stream read from first next time */
+  mux_out_t out[MUX_MAX_STREAMS];
+  int num_seen;                /* Streams received on */
+  size_t held;                 /* Bytes held by all streams */
+};
+
+bool mux_enabled = false;
+
+/** Names of the files of streams other than 0. */
+static const char *mux_pattern;
+
+void mux_init(const char *pattern) {
+  mux_pattern = pattern;
+  mux_enabled = true;
+}
+
+mux_t *mux_new(uint32_t conn_id) {
+  mux_t *mux = calloc(sizeof(mux_t), 1);
+  int i;
+
+  mux->conn_id = conn_id;
+  for (i = 0; i < MUX_MAX_STREAMS; i++) {
+    mux->out[i].ready_tail = &mux->out[i].ready;
+    mux->out[i].fd = -1;
+  }
+  return mux;
+}
+
+void mux_add_input(mux_t *mux, int stream, int fd, struct pollfd *poll) {
+  mux_in_t *in = &mux->in[stream];
+  in->open = true;
+  in->fd = fd;
+  in->poll = poll;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void mux_poll_input(mux_t *mux, bool on) {
+  int i;
+  for (i = 0; i < MUX_MAX_STREAMS; i++) {
+    mux_in_t *in = &mux->in[i];
+    if (!in->open || in->done || in->poll == NULL)
+      continue;
+    if (on)
+      in->poll->events |= POLLIN;
+    else
+      in->poll->events &= ~POLLIN;
+  }
+}
+
+int mux_input(mux_t *mux, char *buf, size_t len) {
+  mux_hdr_t *hdr = (mux_hdr_t *) buf;
+  bool all_done = true;
+  int i;
+
+  for (i = 0; i < MUX_MAX_STREAMS; i++) {
+    int stream = (mux->next_in + i) % MUX_MAX_STREAMS;
+    mux_in_t *in = &mux->in[stream];
+    if (!in->open || in->done)
+      continue;
+    all_done = false;
+
+    int r = read(in->fd, buf + sizeof(mux_hdr_t), len - sizeof(mux_hdr_t));
+    if (r < 0 && errno == EAGAIN)
+      continue;
+
+    /* End of the stream. It hung up, so stop polling it. */
+    if (r <= 0) {
+      in->done = true;
+      if (r == 0 && in->poll != NULL)
+        in->poll->fd = -1;
+      r = 0;
+    }
+    hdr->stream = stream;
+    hdr->flags = in->done ? MUX_FIN : 0;
+    hdr->offset = htonl(in->offset);
+    in->offset += r;
+    mux->next_in = (stream + 1) % MUX_MAX_STREAMS;
+    return sizeof(mux_hdr_t) + r;
+  }
+  return all_done ? -1 : 0;
+}
+
+/**
+ * Moves data that is in order from ahead to ready.
+ */
+static void mux_advance(mux_out_t *out) {
+  mux_piece_t *piece;
+  while ((piece = out->ahead) != NULL && piece->offset == out->next) {
+    out->ahead = piece->next;
+    out->next += piece->len;
+
+    piece->next = NULL;
+    *out->ready_tail = piece;
+    out->ready_tail = &piece->next;
+  }
+}
+
+int mux_receive(mux_t *mux, const char *data, size_t len, uint32_t window) {
+  const mux_hdr_t *hdr = (const mux_hdr_t *) data;
+
+  /* Not a segment of a stream. Take it and drop it. */
+  if (len < sizeof(mux_hdr_t) || hdr->stream >= MUX_MAX_STREAMS)
+    return 0;
+
+  mux_out_t *out = &mux->out[hdr->stream];
+  uint32_t offset = ntohl(hdr->offset);
+  size_t data_len = len - sizeof(mux_hdr_t);
+  bool fin = hdr->flags & MUX_FIN;
+
+  /* Taken before. */
+  if ((fin && out->fin_taken) || offset < out->next ||
+      (offset == out->next && data_len == 0 && !fin))
+    return 0;
+  mux_piece_t **pos = &out->ahead;
+  while (*pos != NULL && (*pos)->offset < offset)
+    pos = &(*pos)->next;
+  if (*pos != NULL && (*pos)->offset == offset && (*pos)->fin == fin)
+    return 0;
+
+  /* Once there are several streams, none of them gets the last quarter of
+     the window, though each can hold at least a full segment. The next
+     piece expected is always taken, or pieces ahead of it could fill the
+     stream's share and keep it out for good. */
+  if (!out->seen) {
+    out->seen = true;
+    mux->num_seen++;
+  }
+  uint32_t share = window / 4 * 3;
+  if (share < MAX_SEG_DATA_SIZE)
+    share = MAX_SEG_DATA_SIZE;
+  if (mux->num_seen > 1 && offset != out->next &&
+      out->held + data_len > share)
+    return -1;
+
+  mux_piece_t *piece = malloc(offsetof(mux_piece_t, data[data_len]));
+  piece->offset = offset;
+  piece->len = data_len;
+  piece->used = 0;
+  piece->fin = fin;
+  out->fin_taken |= fin;
+  memcpy(piece->data, data + sizeof(mux_hdr_t), data_len);
+  piece->next = *pos;
+  *pos = piece;
+
+  out->held += data_len;
+  mux->held += data_len;
+  mux_advance(out);
+  return data_len;
+}
+
+/**
+ * Writes data of a stream other than 0 to its file, opening it first.
+ *
+ * returns: What write() returned, or len if the data is dropped.
+ */
+static int mux_write(mux_t *mux, int stream, const char *buf, size_t len) {
+  mux_out_t *out = &mux->out[stream];
+
+  if (out->fd < 0 && !out->failed) {
+    char path[256];
+    snprintf(path, sizeof(path), mux_pattern, mux->conn_id, stream);
+    out->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (out->fd < 0) {
+      fprintf(stderr, "[ERROR] Could not open %s, dropping stream %d\n", path,
+              stream);
+      out->failed = true;
+    }
+  }
+  if (out->failed)
+    return len;
+
+  int w = write(out->fd, buf, len);
+  if (w < 0 && errno != EAGAIN) {
+    fprintf(stderr, "[ERROR] Could not write stream %d, dropping it\n",
+            stream);
+    out->failed = true;
+    return len;
+  }
+  return w;
+}
+
+size_t mux_output(mux_t *mux, conn_t *conn) {
+  size_t released = 0;
+  int i;
+
+  for (i = 0; i < MUX_MAX_STREAMS; i++) {
+    mux_out_t *out = &mux->out[i];
+    mux_piece_t *piece;
+
+    while ((piece = out->ready) != NULL) {
+      size_t left = piece->len - piece->used;
+      int w = 0;
+
+      /* Stream 0 goes where the connection's output goes, as far as there
+         is room. */
+      if (left > 0 && i == 0) {
+        size_t room = conn_bufspace(conn);
+        if (room > 0)
+          w = conn_output(conn, piece->data + piece->used,
+                          left < room ? left : room);
+      }
+      else if (left > 0) {
+        w = mux_write(mux, i, piece->data + piece->used, left);
+      }
+      if (w <= 0 && left > 0)
+        break;
+
+      piece->used += w;
+      out->held -= w;
+      mux->held -= w;
+      released += w;
+      if (piece->used < piece->len)
+        break;
+
+      /* The stream ended. Its file is done. */
+      if (piece->fin && out->fd >= 0) {
+        close(out->fd);
+        out->fd = -1;
+      }
+      out->ready = piece->next;
+      if (out->ready == NULL)
+        out->ready_tail = &out->ready;
+      free(piece);
+    }
+  }
+  return released;
+}
+
+size_t mux_held(mux_t *mux) {
+  return mux->held;
+}
+
+/**
+ * Frees a list of pieces.
+ */
+static void mux_free_pieces(mux_piece_t *piece) {
+  mux_piece_t *next;
+  for (; piece != NULL; piece = next) {
+    next = piece->next;
+    free(piece);
+  }
+}
+
+void mux_free(mux_t *mux) {
+  int i;
+  for (i = 0; i < MUX_MAX_STREAMS; i++) {
+    mux_out_t *out = &mux->out[i];
+    mux_free_pieces(out->ahead);
+    mux_free_pieces(out->ready);
+    if (out->fd >= 0)
+      close(out->fd);
+  }
+  free(mux);
+}
@@ -0,0 +1,133 @@
+/******************************************************************************
+ * ctcp_mux.h
+ * ----------
+ * Streams multiplexed inside one connection. Separate flows, such as control
+ * messages next to a bulk transfer, would otherwise need a connection each,
+ * with its own handshake and timers, and in a single connection a loss holds
+ * up everything behind it.
+ *
+ * Each segment carries data of one stream, after a header saying where it
+ * goes in that stream:
+ *
+ *   stream (1) | flags (1) | offset (4) | data
+ *
+ * with the offset in network order. A stream ends with a segment carrying
+ * MUX_FIN and no data. Segments received ahead of the next one expected are
+ * taken too, and their data is output as soon as its own stream is in order,
+ * so a lost segment only holds up its own stream. Each stream only gets part
+ * of the receive window once there are several, so one that is not read from
+ * does not stop the others.
+ *
+ * Stream 0 is STDIN, or the program, and its output goes where the output of
+ * the connection would go. The other streams come from files or FIFOs given
+ * to the client, and are written to files named after the connection and the
+ * stream.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_MUX_H
+#define CTCP_MUX_H
+
+#include <poll.h>
+
+#include "ctcp.h"
+
+/** Most streams in one connection. */
+#define MUX_MAX_STREAMS 8
+
+/** Flag of the last segment of a stream. */
+#define MUX_FIN 0x1
+
+/** Start of the data of every segment. */
+typedef struct mux_hdr {
+  uint8_t stream;     /* Stream number */
+  uint8_t flags;      /* MUX_FIN if the stream ends */
+  uint32_t offset;    /* Position of the data in the stream */
+} __attribute__((packed)) mux_hdr_t;
+
+/** Whether or not connections are multiplexed. */
+extern bool mux_enabled;
+
+/**
+ * Turns on multiplexing.
+ *
+ * pattern: Names of the files the other streams are written to, with a %u
+ *          for the connection number and then a %u for the stream number.
+ */
+void mux_init(const char *pattern);
+
+/**
+ * Starts the streams of a new connection.
+ *
+ * conn_id: Number of the connection, to name its files.
+ * returns: The streams.
+ */
+mux_t *mux_new(uint32_t conn_id);
+
+/**
+ * Adds a stream to be sent.
+ *
+ * mux: The connection's streams.
+ * stream: Number of the stream.
+ * fd: Where it is read from. Made asynchronous.
+ * poll: Used to poll fd, NULL if it is not polled.
+ */
+void mux_add_input(mux_t *mux, int stream, int fd, struct pollfd *poll);
+
+/**
+ * Stops or resumes polling the streams to be sent.
+ *
+ * mux: The connection's streams.
+ * on: Whether to poll them (true) or not (false).
+ */
+void mux_poll_input(mux_t *mux, bool on);
+
+/**
+ * Reads the next segment to send, going round the streams so they all get a
+ * turn.
+ *
+ * mux: The connection's streams.
+ * buf: Buffer to read into, header first.
+ * len: Size of the buffer.
+ * returns: The length of the segment, 0 if no stream has input now, or -1
+ *          once all of them ended.
+ */
+int mux_input(mux_t *mux, char *buf, size_t len);
+
+/**
+ * Takes the data of a segment received.
+ *
+ * mux: The connection's streams.
+ * data: The data, header first.
+ * len: Length of the data.
+ * window: Receive window of the connection, in bytes.
+ * returns: The number of bytes now held, or -1 if its stream has no room.
+ *          Segments taken before hold nothing.
+ */
+int mux_receive(mux_t *mux, const char *data, size_t len, uint32_t window);
+
+/**
+ * Outputs the data of every stream that is in order, as far as there is
+ * room.
+ *
+ * mux: The connection's streams.
+ * conn: The connection, for the output of stream 0.
+ * returns: The number of bytes no longer held.
+ */
+size_t mux_output(mux_t *mux, conn_t *conn);
+
+/**
+ * Returns the number of bytes received and not output yet.
+ *
+ * mux: The connection's streams.
+ */
+size_t mux_held(mux_t *mux);
+
+/**
+ * Closes the files of a connection's streams and frees them.
+ *
+ * mux: The connection's streams.
+ */
+void mux_free(mux_t *mux);
+
+#endif /* CTCP_MUX_H */
@@ -0,0 +1,99 @@
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "ctcp_perf.h"
+
+/** A hardware counter to collect. */
+typedef struct perf_counter {
+  const char *name;
+  uint64_t config;          /* PERF_COUNT_HW_* */
+  int fd;                   /* -1 if it could not be opened */
+} perf_counter_t;
+
+bool perf_enabled = false;
+uint64_t perf_bytes = 0;
+
+static pid_t perf_pid;
+
+static perf_counter_t counters[] = {
+  { "cycles", PERF_COUNT_HW_CPU_CYCLES, -1 },
+  { "instructions", PERF_COUNT_HW_INSTRUCTIONS, -1 },
+  { "cache-misses", PERF_COUNT_HW_CACHE_MISSES, -1 },
+  { "branch-misses", PERF_COUNT_HW_BRANCH_MISSES, -1 },
+};
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+/**
+ * Opens a counter for this process on any CPU, starting disabled. Child
+ * processes (e.g. the server's programs) are not counted.
+ */
+static int perf_open(uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Prints out the counters, in total and per MB transferred.
+ */
+static void perf_report() {
+  /* Processes forked off to simulate unreliability exit too. */
+  if (getpid() != perf_pid)
+    return;
+
+  double mb = perf_bytes / 1e6;
+  fprintf(stderr, "[PERF] %llu bytes transferred\n",
+          (unsigned long long) perf_bytes);
+  fprintf(stderr, "%-16s %16s %16s\n", "counter", "total", "per_MB");
+
+  int i;
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    uint64_t value = 0;
+    if (counters[i].fd < 0 ||
+        read(counters[i].fd, &value, sizeof(value)) != sizeof(value)) {
+      fprintf(stderr, "%-16s %16s %16s\n", counters[i].name, "n/a", "n/a");
+      continue;
+    }
+    ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (mb > 0)
+      fprintf(stderr, "%-16s %16llu %16.0f\n", counters[i].name,
+              (unsigned long long) value, value / mb);
+    else
+      fprintf(stderr, "%-16s %16llu %16s\n", counters[i].name,
+              (unsigned long long) value, "n/a");
+  }
+}
+
+int perf_init() {
+  int i, opened = 0;
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    counters[i].fd = perf_open(counters[i].config);
+    if (counters[i].fd >= 0)
+      opened++;
+  }
+  if (opened == 0) {
+    fprintf(stderr, "[ERROR] Could not open hardware performance counters "
+                    "(check /proc/sys/kernel/perf_event_paranoid)\n");
+    return -1;
+  }
+
+  for (i = 0; i < NUM_COUNTERS; i++) {
+    if (counters[i].fd < 0)
+      continue;
+    ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  perf_pid = getpid();
+  perf_enabled = true;
+  atexit(perf_report);
+  return 0;
+}
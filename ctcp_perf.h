@@ -0,0 +1,42 @@
+/******************************************************************************
+ * ctcp_perf.h
+ * -----------
+ * Hardware performance counters (cycles, instructions, cache misses, branch
+ * misses) collected with perf_event_open() over a whole cTCP run. At exit the
+ * totals are printed to STDERR together with the counts per MB of data
+ * transferred (read from the input plus written to the output).
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PERF_H
+#define CTCP_PERF_H
+
+#include "ctcp_sys.h"
+
+/** Whether or not hardware counters are being collected. */
+extern bool perf_enabled;
+
+/** Bytes transferred so far. Only updated if perf_enabled is set. */
+extern uint64_t perf_bytes;
+
+/**
+ * Opens and starts the hardware counters for this process. Prints the report
+ * at exit.
+ *
+ * returns: 0 on success, -1 if none of the counters could be opened (e.g.
+ *          not supported, or not permitted by perf_event_paranoid).
+ */
+int perf_init();
+
+/**
+ * Counts bytes transferred, to normalize the counters with.
+ *
+ * len: Number of bytes read or written.
+ */
+#define PERF_ADD_BYTES(len)     \
+  do {                          \
+    if (perf_enabled)           \
+      perf_bytes += (len);      \
+  } while (0)
+
+#endif /* CTCP_PERF_H */
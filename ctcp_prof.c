@@ -0,0 +1,127 @@
+#include "ctcp_prof.h"
+
+#ifdef CTCP_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROF_USE_TSC 1
+#endif
+
+/** Number of per-connection slots. Connection IDs are folded into these. */
+#define PROF_MAX_CONNS 64
+
+/** Counters for one function and connection. */
+typedef struct prof_counter {
+  uint64_t calls;
+  uint64_t total;
+  uint64_t max;
+} prof_counter_t;
+
+static prof_counter_t counters[PROF_NUM_FUNCS][PROF_MAX_CONNS];
+
+static const char *func_names[PROF_NUM_FUNCS] = {
+  "ctcp_receive",
+  "ctcp_send_data_segment",
+  "cksum",
+  "conn_send",
+  "convert_to_datagram",
+  "conn_drain",
+};
+
+static pid_t prof_pid;
+static uint64_t start_clock;
+static struct timespec start_time;
+
+/**
+ * Returns the number of nanoseconds per prof_clock() unit, measured over the
+ * lifetime of the program.
+ */
+static double prof_ns_per_unit() {
+#ifdef PROF_USE_TSC
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t units = prof_clock() - start_clock;
+  double ns = (now.tv_sec - start_time.tv_sec) * 1e9 +
+              (now.tv_nsec - start_time.tv_nsec);
+  return units ? ns / units : 1;
+#else
+  return 1;
+#endif
+}
+
+/**
+ * Prints out the counters of one function, in total and for each connection.
+ */
+static void prof_print_func(prof_func_t func, double ns_per_unit) {
+  prof_counter_t sum;
+  memset(&sum, 0, sizeof(sum));
+
+  int i;
+  for (i = 0; i < PROF_MAX_CONNS; i++) {
+    sum.calls += counters[func][i].calls;
+    sum.total += counters[func][i].total;
+    if (counters[func][i].max > sum.max)
+      sum.max = counters[func][i].max;
+  }
+  if (sum.calls == 0)
+    return;
+
+  fprintf(stderr, "%-24s %10s %12llu %14.0f %10.0f %10.0f\n",
+          func_names[func], "all", (unsigned long long) sum.calls,
+          sum.total * ns_per_unit / 1000,
+          (double) sum.total * ns_per_unit / sum.calls,
+          sum.max * ns_per_unit);
+
+  for (i = 0; i < PROF_MAX_CONNS; i++) {
+    prof_counter_t *c = &counters[func][i];
+    if (c->calls == 0)
+      continue;
+    fprintf(stderr, "%-24s %10d %12llu %14.0f %10.0f %10.0f\n", "", i,
+            (unsigned long long) c->calls, c->total * ns_per_unit / 1000,
+            (double) c->total * ns_per_unit / c->calls, c->max * ns_per_unit);
+  }
+}
+
+/**
+ * Prints out the summary of all counters.
+ */
+static void prof_summary() {
+  /* Processes forked off to simulate unreliability exit too. */
+  if (getpid() != prof_pid)
+    return;
+
+  double ns_per_unit = prof_ns_per_unit();
+  fprintf(stderr, "[PROFILE] Time spent in hot-path functions (inclusive)\n");
+  fprintf(stderr, "%-24s %10s %12s %14s %10s %10s\n", "function", "conn",
+          "calls", "total_us", "avg_ns", "max_ns");
+  int func;
+  for (func = 0; func < PROF_NUM_FUNCS; func++)
+    prof_print_func(func, ns_per_unit);
+}
+
+void prof_init() {
+  prof_pid = getpid();
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  start_clock = prof_clock();
+  atexit(prof_summary);
+}
+
+uint64_t prof_clock() {
+#ifdef PROF_USE_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void prof_record(prof_func_t func, uint32_t conn_id, uint64_t elapsed) {
+  prof_counter_t *c = &counters[func][conn_id % PROF_MAX_CONNS];
+  c->calls++;
+  c->total += elapsed;
+  if (elapsed > c->max)
+    c->max = elapsed;
+}
+
+#endif /* CTCP_PROFILE */
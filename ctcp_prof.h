@@ -0,0 +1,71 @@
+/******************************************************************************
+ * ctcp_prof.h
+ * -----------
+ * Hot-path profiling counters. When built with -DCTCP_PROFILE (make profile),
+ * calls to the functions below are timed with the CPU timestamp counter (or
+ * clock_gettime() where there is none) and aggregated per function and per
+ * connection. A summary is printed to STDERR at exit.
+ *
+ * In normal builds all of the macros expand to nothing (or to the plain call)
+ * so there is no cost at all.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PROF_H
+#define CTCP_PROF_H
+
+#include "ctcp_sys.h"
+
+/** Profiled functions. Times are inclusive of nested profiled calls. */
+typedef enum prof_func {
+  PROF_CTCP_RECEIVE,
+  PROF_CTCP_SEND_DATA_SEGMENT,
+  PROF_CKSUM,
+  PROF_CONN_SEND,
+  PROF_CONVERT_TO_DATAGRAM,
+  PROF_CONN_DRAIN,
+  PROF_NUM_FUNCS
+} prof_func_t;
+
+#ifdef CTCP_PROFILE
+
+/**
+ * Starts profiling. Prints out the summary at exit.
+ */
+void prof_init();
+
+/**
+ * Reads the profiling clock. In cycles if the timestamp counter is available,
+ * in nanoseconds otherwise.
+ */
+uint64_t prof_clock();
+
+/**
+ * Adds one timed call to the counters.
+ *
+ * func: The function that was called.
+ * conn_id: The connection it was called for, 0 if none.
+ * elapsed: Time taken, in prof_clock() units.
+ */
+void prof_record(prof_func_t func, uint32_t conn_id, uint64_t elapsed);
+
+#define PROF_ENABLED 1
+#define PROF_INIT() prof_init()
+
+/** Times a statement (usually a call, possibly with an assignment). */
+#define PROF_CALL(func, conn_id, call)                        \
+  do {                                                        \
+    uint64_t _prof_start = prof_clock();                      \
+    call;                                                     \
+    prof_record((func), (conn_id), prof_clock() - _prof_start); \
+  } while (0)
+
+#else
+
+#define PROF_ENABLED 0
+#define PROF_INIT()
+#define PROF_CALL(func, conn_id, call) do { call; } while (0)
+
+#endif /* CTCP_PROFILE */
+
+#endif /* CTCP_PROF_H */
@@ -0,0 +1,175 @@
+#include <limits.h>
+
+#include "ctcp_ratelimit.h"
+#include "ctcp_utils.h"
+
+/** Limits of one direction. */
+typedef struct rate_limits {
+  rate_limit_t conn;    /* For each connection */
+  rate_limit_t total;   /* For all connections together */
+} rate_limits_t;
+
+bool ratelimit_enabled = false;
+
+/** Limits from the command line. */
+static rate_limits_t base[2];
+
+/** Limits in use, the ones from the command line with the file on top. */
+static rate_limits_t limits[2];
+
+/** Buckets shared by all connections. */
+static rate_bucket_t total_buckets[2];
+
+static char *limits_file;
+static volatile sig_atomic_t reload;
+
+/**
+ * Limit named by an option.
+ */
+static rate_limit_t *ratelimit_named(rate_limits_t *l, const char *name) {
+  if (strcmp(name, "send-rate") == 0)
+    return &l[RATE_SEND].conn;
+  if (strcmp(name, "recv-rate") == 0)
+    return &l[RATE_RECV].conn;
+  if (strcmp(name, "total-send-rate") == 0)
+    return &l[RATE_SEND].total;
+  if (strcmp(name, "total-recv-rate") == 0)
+    return &l[RATE_RECV].total;
+  return NULL;
+}
+
+/**
+ * Reads the limits file on top of the command-line limits. Keeps the old
+ * limits if the file has an error.
+ */
+static int ratelimit_load() {
+  FILE *f = fopen(limits_file, "r");
+  if (f == NULL) {
+    fprintf(stderr, "[ERROR] Could not open rate limits file %s\n",
+            limits_file);
+    return -1;
+  }
+
+  rate_limits_t loaded[2];
+  memcpy(loaded, base, sizeof(loaded));
+
+  char line[256];
+  int n = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char name[64], value[64];
+    n++;
+    if (sscanf(line, "%63s %63s", name, value) < 1 || name[0] == '#')
+      continue;
+
+    rate_limit_t *limit = ratelimit_named(loaded, name);
+    if (limit == NULL || ratelimit_parse(value, limit) < 0) {
+      fprintf(stderr, "[ERROR] Bad rate limit on line %d of %s\n", n,
+              limits_file);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+
+  memcpy(limits, loaded, sizeof(limits));
+  return 0;
+}
+
+static void ratelimit_signal(int sig) {
+  reload = 1;
+}
+
+/**
+ * Adds the tokens earned since the bucket was last filled. A new bucket
+ * starts full.
+ */
+static void ratelimit_fill(rate_bucket_t *bucket, const rate_limit_t *limit,
+                           long now) {
+  if (bucket->last == 0) {
+    bucket->tokens = limit->burst;
+    bucket->last = now;
+  }
+
+  /* Only move on once a whole byte was earned, so slow rates still fill up
+     when this is called often. */
+  long earned = limit->rate * (now - bucket->last) / 1000;
+  if (earned > 0) {
+    bucket->tokens += earned;
+    bucket->last = now;
+  }
+  if (bucket->tokens >= limit->burst) {
+    bucket->tokens = limit->burst;
+    bucket->last = now;
+  }
+}
+
+int ratelimit_parse(const char *arg, rate_limit_t *limit) {
+  char *end;
+  long rate = strtol(arg, &end, 10);
+  long burst = rate * RATE_DEFAULT_BURST_MS / 1000;
+
+  if (*end == ':')
+    burst = strtol(end + 1, &end, 10);
+  if (*end != '\0' || rate < 0 || burst < 0)
+    return -1;
+
+  limit->rate = rate;
+  limit->burst = burst > RATE_MIN_BURST ? burst : RATE_MIN_BURST;
+  return 0;
+}
+
+void ratelimit_set(rate_dir_t dir, bool total, const rate_limit_t *limit) {
+  if (total)
+    base[dir].total = *limit;
+  else
+    base[dir].conn = *limit;
+  limits[dir] = base[dir];
+  ratelimit_enabled = true;
+}
+
+int ratelimit_init(const char *filename) {
+  limits_file = strdup(filename);
+  if (ratelimit_load() < 0)
+    return -1;
+
+  signal(SIGHUP, ratelimit_signal);
+  ratelimit_enabled = true;
+  return 0;
+}
+
+void ratelimit_poll() {
+  if (!reload)
+    return;
+
+  reload = 0;
+  if (ratelimit_load() == 0)
+    fprintf(stderr, "[INFO] Reloaded rate limits from %s\n", limits_file);
+}
+
+long ratelimit_available(rate_bucket_t *bucket, rate_dir_t dir) {
+  rate_limits_t *l = &limits[dir];
+  long now = current_time();
+  long available = LONG_MAX;
+
+  if (l->conn.rate > 0) {
+    ratelimit_fill(bucket, &l->conn, now);
+    available = bucket->tokens;
+  }
+  if (l->total.rate > 0) {
+    ratelimit_fill(&total_buckets[dir], &l->total, now);
+    if (total_buckets[dir].tokens < available)
+      available = total_buckets[dir].tokens;
+  }
+  return available;
+}
+
+bool ratelimit_take(rate_bucket_t *bucket, rate_dir_t dir, long bytes) {
+  if (ratelimit_available(bucket, dir) < bytes)
+    return false;
+
+  if (limits[dir].conn.rate > 0)
+    bucket->tokens -= bytes;
+  if (limits[dir].total.rate > 0)
+    total_buckets[dir].tokens -= bytes;
+  return true;
+}
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * ctcp_ratelimit.h
+ * ----------------
+ * Token bucket rate limits. Every connection may send and receive at most a
+ * set number of bytes per second, and so may all connections together. A
+ * bucket fills up at the rate and holds at most the burst, so a connection
+ * that was quiet for a while may go faster for a moment.
+ *
+ * Sending is held back in the send path. Receiving is held back by shrinking
+ * the window advertised to the other host, and data it sends anyway is
+ * dropped.
+ *
+ * Limits are given on the command line, and may also be read from a file,
+ * which is read again on SIGHUP so they can be changed while running.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_RATELIMIT_H
+#define CTCP_RATELIMIT_H
+
+#include "ctcp.h"
+
+/** Burst when none is given, in milliseconds of the rate. */
+#define RATE_DEFAULT_BURST_MS 100
+
+/** Smallest burst, so that a segment can be on its way while the bucket
+    fills up for the next one. */
+#define RATE_MIN_BURST (2 * MAX_SEG_DATA_SIZE)
+
+/** Direction of the data a bucket is for. */
+typedef enum {
+  RATE_SEND,
+  RATE_RECV
+} rate_dir_t;
+
+/** A rate and the burst allowed above it. */
+typedef struct rate_limit {
+  long rate;   /* Bytes per second, 0 for no limit */
+  long burst;  /* Size of the bucket, in bytes */
+} rate_limit_t;
+
+/** A bucket of tokens. Embed one per direction in the connection. */
+typedef struct rate_bucket {
+  long tokens; /* Bytes that may go now */
+  long last;   /* Time it was last filled, in ms, 0 if never */
+} rate_bucket_t;
+
+/** Whether or not any limits may be set. */
+extern bool ratelimit_enabled;
+
+/**
+ * Parses a limit given as "rate[:burst]", in bytes per second and bytes.
+ *
+ * arg: The string to parse.
+ * limit: Return parameter. The limit parsed.
+ * returns: 0 on success, -1 if it is not a valid limit.
+ */
+int ratelimit_parse(const char *arg, rate_limit_t *limit);
+
+/**
+ * Sets a limit, for every connection or for all connections together.
+ * Turns on rate limiting.
+ *
+ * dir: Whether the limit is for sending or receiving.
+ * total: Whether the limit is for all connections together.
+ * limit: The limit.
+ */
+void ratelimit_set(rate_dir_t dir, bool total, const rate_limit_t *limit);
+
+/**
+ * Reads limits from a file, on top of the ones from the command line, and
+ * reads it again whenever SIGHUP is received. Each line holds an option name
+ * and a limit, such as "recv-rate 100000:20000". Lines starting with # are
+ * ignored.
+ *
+ * filename: The file to read.
+ * returns: 0 on success, -1 if the file could not be read.
+ */
+int ratelimit_init(const char *filename);
+
+/**
+ * Reads the file again if SIGHUP was received since the last call. Called
+ * from the timer.
+ */
+void ratelimit_poll();
+
+/**
+ * Number of bytes a connection may send or receive right now.
+ *
+ * bucket: The connection's bucket for that direction.
+ * dir: The direction.
+ * returns: The bytes, or LONG_MAX if there is no limit.
+ */
+long ratelimit_available(rate_bucket_t *bucket, rate_dir_t dir);
+
+/**
+ * Takes tokens for data about to be sent or just received, if there are
+ * enough.
+ *
+ * bucket: The connection's bucket for that direction.
+ * dir: The direction.
+ * bytes: Length of the data.
+ * returns: Whether or not the data is within the limits.
+ */
+bool ratelimit_take(rate_bucket_t *bucket, rate_dir_t dir, long bytes);
+
+#endif /* CTCP_RATELIMIT_H */
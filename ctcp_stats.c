@@ -0,0 +1,54 @@
+#include "ctcp_stats.h"
+#include "ctcp_utils.h"
+
+#define STATS_LINE_SIZE 256
+
+bool stats_enabled = false;
+
+static int stats_file = -1;
+static int stats_interval;
+static long stats_start;
+static long stats_last;
+
+int stats_init(const char *filename, int interval) {
+  stats_file = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (stats_file < 0) {
+    fprintf(stderr, "[ERROR] Could not open statistics file %s\n", filename);
+    return -1;
+  }
+  write(stats_file, STATS_HEADERS, strlen(STATS_HEADERS));
+
+  stats_interval = interval > 0 ? interval : STATS_DEFAULT_INTERVAL;
+  stats_start = current_time();
+  stats_last = stats_start;
+  stats_enabled = true;
+  return 0;
+}
+
+bool stats_due(long now) {
+  if (now - stats_last < stats_interval)
+    return false;
+
+  /* Keep a steady cadence, unless we fell behind by a whole interval. */
+  stats_last += stats_interval;
+  if (now - stats_last >= stats_interval)
+    stats_last = now;
+  return true;
+}
+
+void stats_write(long now, const stats_sample_t *sample) {
+  char buf[STATS_LINE_SIZE];
+  int len = snprintf(buf, STATS_LINE_SIZE,
+                     "%ld,%u,%u,%u,%u,%u,%u,%.3f,%.3f,%llu,%llu,%.1f,%.1f\n",
+                     now - stats_start, sample->conn_id, sample->send_window,
+                     sample->send_window_used, sample->rcv_window,
+                     sample->rcv_window_used, sample->inflight,
+                     sample->srtt / 1000.0, sample->rttvar / 1000.0,
+                     (unsigned long long) sample->bytes_acked,
+                     (unsigned long long) sample->bytes_output,
+                     sample->tx_goodput * 8 / 1000.0,
+                     sample->rx_goodput * 8 / 1000.0);
+  /* Unbuffered so processes forked off by conn_send() don't write out
+     copies of pending samples when they exit. */
+  write(stats_file, buf, len);
+}
@@ -0,0 +1,67 @@
+/******************************************************************************
+ * ctcp_stats.h
+ * ------------
+ * Periodic export of per-connection state (window usage, bytes in flight,
+ * smoothed RTT, goodput) into a CSV time-series file. Samples are taken from
+ * ctcp_timer(), so the sampling interval is rounded up to the timer interval.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_STATS_H
+#define CTCP_STATS_H
+
+#include "ctcp_sys.h"
+
+/** Default interval between samples, in milliseconds. */
+#define STATS_DEFAULT_INTERVAL 100
+
+/** Headers for the statistics file. */
+#define STATS_HEADERS "time_ms,conn,send_window,send_window_used,rcv_window,rcv_window_used,inflight,srtt_ms,rttvar_ms,bytes_acked,bytes_output,tx_goodput_kbps,rx_goodput_kbps\n"
+
+/** One sample of a connection's state. */
+typedef struct stats_sample {
+  uint32_t conn_id;           /* Connection the sample belongs to */
+  uint16_t send_window;       /* Send window, in bytes */
+  uint16_t send_window_used;  /* Send window in use, in bytes */
+  uint16_t rcv_window;        /* Receive window, in bytes */
+  uint16_t rcv_window_used;   /* Receive window in use, in bytes */
+  uint32_t inflight;          /* Bytes sent but not yet acknowledged */
+  long srtt;                  /* Smoothed RTT, in microseconds */
+  long rttvar;                /* RTT variation, in microseconds */
+  uint64_t bytes_acked;       /* Total bytes acknowledged by the other host */
+  uint64_t bytes_output;      /* Total bytes written to the output */
+  uint64_t tx_goodput;        /* Bytes acknowledged per second since the
+                                 previous sample */
+  uint64_t rx_goodput;        /* Bytes output per second since the previous
+                                 sample */
+} stats_sample_t;
+
+/** Whether or not statistics are being exported. */
+extern bool stats_enabled;
+
+/**
+ * Turns on statistics export. Writes the CSV headers to the file.
+ *
+ * filename: File to write samples to. Overwritten if it exists.
+ * interval: Time between samples, in milliseconds.
+ * returns: 0 on success, -1 if the file could not be opened.
+ */
+int stats_init(const char *filename, int interval);
+
+/**
+ * Checks whether it is time to take another round of samples. Returns true at
+ * most once per interval.
+ *
+ * now: The current time, in milliseconds.
+ */
+bool stats_due(long now);
+
+/**
+ * Writes one sample into the statistics file.
+ *
+ * now: Time the sample was taken, in milliseconds.
+ * sample: The sample.
+ */
+void stats_write(long now, const stats_sample_t *sample);
+
+#endif /* CTCP_STATS_H */
@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/wait.h>
+
+#include "ctcp_stripe.h"
+#include "ctcp_utils.h"
+
+/** A chunk that came in, waiting for those before it or to be written. */
+typedef struct stripe_chunk {
+  struct stripe_chunk *next;
+  uint32_t seq;       /* Number of the chunk */
+  size_t len;         /* Length of the data */
+  size_t used;        /* Data already received, or written once in order */
+  char data[];
+} stripe_chunk_t;
+
+/** A transfer being put back together. */
+typedef struct stripe_group {
+  bool in_use;
+  uint32_t id;                 /* Transfer, from the hello */
+  int count;                   /* Number of connections */
+  int members;                 /* Connections still around */
+  int left;                    /* Connections that are gone */
+  int done;                    /* Connections that sent all their chunks */
+  uint32_t next_seq;           /* Next chunk to write */
+  stripe_chunk_t *waiting;     /* Chunks after next_seq, in order */
+  size_t buffered;             /* Bytes in waiting */
+  uint64_t written;            /* Bytes put in order so far */
+} stripe_group_t;
+
+struct stripe_member {
+  stripe_group_t *group;       /* NULL until the hello came in */
+  stripe_hello_t hello;        /* Hello, as it comes in */
+  size_t hello_len;
+  stripe_hdr_t hdr;            /* Header of the next chunk, as it comes in */
+  size_t hdr_len;
+  stripe_chunk_t *cur;         /* Chunk coming in, NULL between chunks */
+  bool blocked;                /* Output was refused */
+  bool done;                   /* Sent all its chunks */
+};
+
+bool stripe_server = false;
+
+static stripe_group_t groups[STRIPE_MAX_GROUPS];
+
+/** Chunks in order, waiting for room in STDOUT. */
+static stripe_chunk_t *out_queue;
+static stripe_chunk_t **out_queue_tail = &out_queue;
+
+/**
+ * Writes all of a buffer to a blocking fd.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    int w = write(fd, buf, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    buf += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/**
+ * Reads STDIN and sends each chunk to the first client with room for it,
+ * going round so they all get a turn.
+ */
+static int stripe_split(int count, int *fds, uint32_t group) {
+  char buf[sizeof(stripe_hdr_t) + STRIPE_CHUNK];
+  stripe_hdr_t *hdr = (stripe_hdr_t *) buf;
+  struct pollfd polls[STRIPE_MAX_CONNS];
+  uint32_t seq = 0;
+  int i, r, next = 0;
+
+  for (i = 0; i < count; i++) {
+    stripe_hello_t hello;
+    memcpy(hello.magic, "STRP", 4);
+    hello.group = htonl(group);
+    hello.index = htons(i);
+    hello.count = htons(count);
+    if (write_all(fds[i], (char *) &hello, sizeof(hello)) < 0)
+      return -1;
+    polls[i].fd = fds[i];
+    polls[i].events = POLLOUT;
+  }
+
+  while ((r = read(STDIN_FILENO, buf + sizeof(stripe_hdr_t), STRIPE_CHUNK))
+         != 0) {
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return -1;
+    hdr->seq = htonl(seq++);
+    hdr->len = htonl(r);
+
+    if (poll(polls, count, -1) < 0 && errno != EINTR)
+      return -1;
+    for (i = 0; i < count; i++) {
+      if (polls[(next + i) % count].revents)
+        break;
+    }
+    i = (next + (i < count ? i : 0)) % count;
+    next = (i + 1) % count;
+    if (write_all(fds[i], buf, sizeof(stripe_hdr_t) + r) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int stripe_start(int count) {
+  int fds[STRIPE_MAX_CONNS];
+  uint32_t group;
+  int i, j;
+
+  if (random_bytes(&group, sizeof(group)) < 0)
+    group = getpid() ^ time(NULL);
+
+  for (i = 0; i < count; i++) {
+    int p[2];
+    if (pipe(p) < 0)
+      return -1;
+
+    if (fork() == 0) {
+      /* Only keep this client's share of the input. */
+      for (j = 0; j < i; j++)
+        close(fds[j]);
+      close(p[1]);
+      dup2(p[0], STDIN_FILENO);
+      close(p[0]);
+      return i;
+    }
+    close(p[0]);
+    fds[i] = p[1];
+  }
+
+  /* A client that is gone is noticed from write(). */
+  signal(SIGPIPE, SIG_IGN);
+  int err = stripe_split(count, fds, group);
+  if (err < 0)
+    fprintf(stderr, "[ERROR] Could not split the input across connections\n");
+  for (i = 0; i < count; i++)
+    close(fds[i]);
+
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      err = -1;
+  }
+  exit(err < 0 ? 1 : 0);
+}
+
+stripe_member_t *stripe_member_new() {
+  return calloc(sizeof(stripe_member_t), 1);
+}
+
+/**
+ * Drops a transfer.
+ */
+static void stripe_end(stripe_group_t *group) {
+  if (group->done == group->count && group->waiting == NULL)
+    fprintf(stderr, "[INFO] Striped transfer %u done, %llu bytes\n",
+            group->id, (unsigned long long) group->written);
+  else
+    fprintf(stderr, "[ERROR] Striped transfer %u ended before chunk %u came "
+            "in\n", group->id, group->next_seq);
+
+  stripe_chunk_t *chunk, *next;
+  for (chunk = group->waiting; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  group->in_use = false;
+}
+
+/**
+ * Finds the transfer a hello names, or starts it.
+ */
+static stripe_group_t *stripe_join(stripe_hello_t *hello) {
+  uint32_t id = ntohl(hello->group);
+  int count = ntohs(hello->count);
+  stripe_group_t *free_group = NULL;
+  int i;
+
+  if (memcmp(hello->magic, "STRP", 4) != 0 || count < 1 ||
+      count > STRIPE_MAX_CONNS)
+    return NULL;
+
+  for (i = 0; i < STRIPE_MAX_GROUPS; i++) {
+    if (groups[i].in_use && groups[i].id == id)
+      break;
+    if (!groups[i].in_use && free_group == NULL)
+      free_group = &groups[i];
+  }
+  stripe_group_t *group = i < STRIPE_MAX_GROUPS ? &groups[i] : free_group;
+
+  /* No room. Give up on a transfer whose connections are all gone. */
+  for (i = 0; group == NULL && i < STRIPE_MAX_GROUPS; i++) {
+    if (groups[i].members == 0) {
+      stripe_end(&groups[i]);
+      group = &groups[i];
+    }
+  }
+  if (group == NULL)
+    return NULL;
+
+  if (!group->in_use) {
+    memset(group, 0, sizeof(*group));
+    group->in_use = true;
+    group->id = id;
+    group->count = count;
+    fprintf(stderr, "[INFO] Striped transfer %u over %d connections\n", id,
+            count);
+  }
+  group->members++;
+  return group;
+}
+
+/**
+ * Puts chunks that are in order on the output queue.
+ */
+static void stripe_advance(stripe_group_t *group) {
+  stripe_chunk_t *chunk;
+  while ((chunk = group->waiting) != NULL && chunk->seq == group->next_seq) {
+    group->waiting = chunk->next;
+    group->buffered -= chunk->len;
+    group->next_seq++;
+    group->written += chunk->len;
+
+    chunk->next = NULL;
+    chunk->used = 0;
+    *out_queue_tail = chunk;
+    out_queue_tail = &chunk->next;
+  }
+}
+
+/**
+ * Adds a chunk that came in completely.
+ */
+static void stripe_add(stripe_group_t *group, stripe_chunk_t *chunk) {
+  stripe_chunk_t **pos = &group->waiting;
+  while (*pos != NULL && (*pos)->seq < chunk->seq)
+    pos = &(*pos)->next;
+  chunk->next = *pos;
+  *pos = chunk;
+  group->buffered += chunk->len;
+  stripe_advance(group);
+}
+
+/**
+ * Ends a transfer once all its connections came and went. Those that are
+ * gone may have been quicker than the last ones to connect.
+ */
+static void stripe_leave(stripe_group_t *group) {
+  group->members--;
+  if (++group->left >= group->count)
+    stripe_end(group);
+}
+
+int stripe_output(stripe_member_t *m, const char *buf, size_t len) {
+  size_t n;
+
+  if (len == 0) {
+    if (m->group != NULL && !m->done) {
+      m->done = true;
+      m->group->done++;
+    }
+    return 0;
+  }
+
+  for (n = 0; n < len; ) {
+    /* The hello first. */
+    if (m->group == NULL) {
+      size_t take = sizeof(stripe_hello_t) - m->hello_len;
+      take = take < len - n ? take : len - n;
+      memcpy((char *) &m->hello + m->hello_len, buf + n, take);
+      m->hello_len += take;
+      n += take;
+      if (m->hello_len < sizeof(stripe_hello_t))
+        continue;
+
+      m->group = stripe_join(&m->hello);
+      if (m->group == NULL) {
+        fprintf(stderr, "[ERROR] Connection is not part of a striped "
+                "transfer\n");
+        return -1;
+      }
+      continue;
+    }
+
+    /* Then the header of each chunk. */
+    if (m->cur == NULL) {
+      size_t take = sizeof(stripe_hdr_t) - m->hdr_len;
+      take = take < len - n ? take : len - n;
+      memcpy((char *) &m->hdr + m->hdr_len, buf + n, take);
+      m->hdr_len += take;
+      n += take;
+      if (m->hdr_len < sizeof(stripe_hdr_t))
+        continue;
+
+      size_t chunk_len = ntohl(m->hdr.len);
+      if (chunk_len == 0 || chunk_len > STRIPE_CHUNK) {
+        fprintf(stderr, "[ERROR] Bad chunk in striped transfer %u\n",
+                m->group->id);
+        return -1;
+      }
+      m->cur = malloc(offsetof(stripe_chunk_t, data[chunk_len]));
+      m->cur->seq = ntohl(m->hdr.seq);
+      m->cur->len = chunk_len;
+      m->cur->used = 0;
+      m->hdr_len = 0;
+      continue;
+    }
+
+    /* And its data. */
+    size_t take = m->cur->len - m->cur->used;
+    take = take < len - n ? take : len - n;
+    memcpy(m->cur->data + m->cur->used, buf + n, take);
+    m->cur->used += take;
+    n += take;
+    if (m->cur->used == m->cur->len) {
+      stripe_add(m->group, m->cur);
+      m->cur = NULL;
+    }
+  }
+  return len;
+}
+
+bool stripe_room(stripe_member_t *m) {
+  bool room = m->group == NULL || m->cur == NULL ||
+              m->cur->seq == m->group->next_seq ||
+              m->group->buffered < STRIPE_MAX_BUFFERED;
+  if (!room)
+    m->blocked = true;
+  return room;
+}
+
+bool stripe_unblocked(stripe_member_t *m) {
+  if (!m->blocked || !stripe_room(m))
+    return false;
+  m->blocked = false;
+  return true;
+}
+
+void stripe_member_free(stripe_member_t *m) {
+  if (m->group != NULL)
+    stripe_leave(m->group);
+  free(m->cur);
+  free(m);
+}
+
+bool stripe_drain() {
+  stripe_chunk_t *chunk;
+  while ((chunk = out_queue) != NULL) {
+    int w = write(STDOUT_FILENO, chunk->data + chunk->used,
+                  chunk->len - chunk->used);
+    if (w < 0)
+      return errno == EAGAIN;
+
+    chunk->used += w;
+    if (chunk->used < chunk->len)
+      return true;
+    out_queue = chunk->next;
+    if (out_queue == NULL)
+      out_queue_tail = &out_queue;
+    free(chunk);
+  }
+  return false;
+}
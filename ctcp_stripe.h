@@ -0,0 +1,126 @@
+/******************************************************************************
+ * ctcp_stripe.h
+ * -------------
+ * Striped transfers over several connections. One connection is bounded by
+ * its window and slowed down by every loss, so a client may instead open a
+ * few connections to the server and spread its input across them.
+ *
+ * The client forks one ordinary client for each connection, each on its own
+ * port, and cuts its input into numbered chunks. Each chunk goes to whichever
+ * connection has room for it first, so faster connections carry more. Each
+ * connection starts with a hello naming the transfer, followed by its chunks:
+ *
+ *   hello: "STRP" | transfer (4) | index (2) | connections (2)
+ *   chunk: number (4) | length (4) | data
+ *
+ * all in network order. The server collects the chunks of each transfer from
+ * all its connections and writes them out in order. A connection whose next
+ * chunk is too far ahead is not read from while much is waiting, so memory
+ * stays bounded and the chunk that is waited for can always come in.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_STRIPE_H
+#define CTCP_STRIPE_H
+
+#include "ctcp.h"
+
+/** Most connections in one transfer. */
+#define STRIPE_MAX_CONNS 8
+
+/** Most transfers being put back together at once. */
+#define STRIPE_MAX_GROUPS 16
+
+/** Size of a chunk of input, in bytes. */
+#define STRIPE_CHUNK (4 * MAX_SEG_DATA_SIZE)
+
+/** Bytes a transfer may hold out of order before connections whose next
+    chunk is not the one waited for stop being read. */
+#define STRIPE_MAX_BUFFERED (64 * STRIPE_CHUNK)
+
+/** Start of every connection of a striped transfer. */
+typedef struct stripe_hello {
+  char magic[4];      /* "STRP" */
+  uint32_t group;     /* Transfer, the same on all its connections */
+  uint16_t index;     /* Index of this connection */
+  uint16_t count;     /* Number of connections */
+} __attribute__((packed)) stripe_hello_t;
+
+/** Start of every chunk. */
+typedef struct stripe_hdr {
+  uint32_t seq;       /* Number of the chunk, from 0 */
+  uint32_t len;       /* Length of the data after this */
+} __attribute__((packed)) stripe_hdr_t;
+
+/** A connection's part in a striped transfer, on the server. */
+typedef struct stripe_member stripe_member_t;
+
+/** Whether or not the server puts striped transfers back together. */
+extern bool stripe_server;
+
+/**
+ * [Client only]
+ * Forks a client for each connection, and splits STDIN across them. Only
+ * returns in the clients, with STDIN replaced by their share of the transfer.
+ * The parent waits for all of them and exits.
+ *
+ * count: Number of connections.
+ * returns: The index of the client, or -1 if they could not be started.
+ */
+int stripe_start(int count);
+
+/**
+ * [Server only]
+ * Starts putting back together what a new connection sends.
+ *
+ * returns: The connection's part in its transfer.
+ */
+stripe_member_t *stripe_member_new();
+
+/**
+ * [Server only]
+ * Takes output received on a connection. Chunks are written to STDOUT once
+ * all those before them came in.
+ *
+ * m: The connection's part.
+ * buf: The output.
+ * len: Length of the output, 0 for EOF.
+ * returns: len, or -1 if the connection is not part of a striped transfer.
+ */
+int stripe_output(stripe_member_t *m, const char *buf, size_t len);
+
+/**
+ * [Server only]
+ * Whether or not more output may be taken from a connection.
+ *
+ * m: The connection's part.
+ */
+bool stripe_room(stripe_member_t *m);
+
+/**
+ * [Server only]
+ * Whether or not a connection that was refused output may go on now that
+ * chunks were written. Only says so once.
+ *
+ * m: The connection's part.
+ */
+bool stripe_unblocked(stripe_member_t *m);
+
+/**
+ * [Server only]
+ * Ends a connection's part. The transfer is dropped once no connection is
+ * left, even if it was not complete.
+ *
+ * m: The connection's part.
+ */
+void stripe_member_free(stripe_member_t *m);
+
+/**
+ * [Server only]
+ * Writes chunks that are in order to STDOUT, as far as it takes them.
+ *
+ * returns: Whether or not some are left, to poll STDOUT for room.
+ */
+bool stripe_drain();
+
+#endif /* CTCP_STRIPE_H */
@@ -0,0 +1,54 @@
+#include "ctcp_syncookie.h"
+#include "ctcp_utils.h"
+
+#define SYNCOOKIE_HASH_BITS (32 - SYNCOOKIE_TIME_BITS)
+#define SYNCOOKIE_TIME_MASK ((1 << SYNCOOKIE_TIME_BITS) - 1)
+#define SYNCOOKIE_HASH_MASK ((1 << SYNCOOKIE_HASH_BITS) - 1)
+
+static uint64_t secret[2];
+
+/**
+ * Returns the current period counter.
+ */
+static uint32_t syncookie_time() {
+  return current_time() / 1000 / SYNCOOKIE_PERIOD;
+}
+
+/**
+ * Computes a cookie for a given period counter.
+ */
+static uint32_t syncookie_compute(in_addr_t ip_addr, int port,
+                                  uint32_t their_init_seqno, int opts,
+                                  uint32_t t) {
+  t &= SYNCOOKIE_TIME_MASK;
+  uint64_t h = mix64(secret[0] ^ ((uint64_t) ip_addr << 32 | their_init_seqno));
+  h = mix64(h ^ secret[1] ^ ((uint64_t) (port | opts << 16) << 32 | t));
+  return t << SYNCOOKIE_HASH_BITS | (h & SYNCOOKIE_HASH_MASK);
+}
+
+int syncookie_init() {
+  if (random_bytes(secret, sizeof(secret)) < 0) {
+    fprintf(stderr, "[ERROR] Could not make a SYN cookie secret\n");
+    return -1;
+  }
+  return 0;
+}
+
+uint32_t syncookie_make(in_addr_t ip_addr, int port, uint32_t their_init_seqno,
+                        int opts) {
+  return syncookie_compute(ip_addr, port, their_init_seqno, opts,
+                           syncookie_time());
+}
+
+bool syncookie_check(in_addr_t ip_addr, int port, uint32_t their_init_seqno,
+                     uint32_t cookie, int *opts) {
+  uint32_t t = syncookie_time();
+  for (*opts = 0; *opts <= SYNCOOKIE_OPT_ALL; (*opts)++) {
+    if (cookie == syncookie_compute(ip_addr, port, their_init_seqno, *opts,
+                                    t) ||
+        cookie == syncookie_compute(ip_addr, port, their_init_seqno, *opts,
+                                    t - 1))
+      return true;
+  }
+  return false;
+}
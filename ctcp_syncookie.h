@@ -0,0 +1,67 @@
+/******************************************************************************
+ * ctcp_syncookie.h
+ * ----------------
+ * SYN cookies. Instead of setting up a connection for every SYN, a server
+ * answers with a SYN-ACK whose initial sequence number encodes the client's
+ * address, port and initial sequence number, keyed with a secret and the
+ * time. Nothing is kept until the client's ACK comes back with the cookie
+ * plus one, so a burst of SYNs costs no memory.
+ *
+ * The top SYNCOOKIE_TIME_BITS bits of a cookie hold a counter that goes up
+ * every SYNCOOKIE_PERIOD seconds; a cookie is accepted during the period it
+ * was made in and the one after.
+ *
+ * Options the server agreed to in its SYN-ACK cannot be kept either, so they
+ * go into the hash as well, and are found again by trying each combination.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_SYNCOOKIE_H
+#define CTCP_SYNCOOKIE_H
+
+#include "ctcp_sys.h"
+
+/** Length of a cookie period, in seconds. */
+#define SYNCOOKIE_PERIOD 64
+
+/** Bits of a cookie used for the period counter. */
+#define SYNCOOKIE_TIME_BITS 5
+
+/** Options a cookie carries. */
+#define SYNCOOKIE_OPT_COMPRESS 0x1
+#define SYNCOOKIE_OPT_ALL 0x1
+
+/**
+ * Makes up the secret cookies are derived from.
+ *
+ * returns: 0 on success, -1 if the secret could not be made.
+ */
+int syncookie_init();
+
+/**
+ * Computes the initial sequence number to answer a SYN with.
+ *
+ * ip_addr: IP address of the client.
+ * port: Port of the client.
+ * their_init_seqno: The client's initial sequence number.
+ * opts: Options agreed to, SYNCOOKIE_OPT_* flags.
+ * returns: The cookie.
+ */
+uint32_t syncookie_make(in_addr_t ip_addr, int port, uint32_t their_init_seqno,
+                        int opts);
+
+/**
+ * Checks the cookie acknowledged by a client completing the handshake.
+ *
+ * ip_addr: IP address of the client.
+ * port: Port of the client.
+ * their_init_seqno: The client's initial sequence number (the sequence
+ *                   number of its ACK minus one).
+ * cookie: Our initial sequence number (the ack number minus one).
+ * opts: Return parameter. Options agreed to, SYNCOOKIE_OPT_* flags.
+ * returns: Whether or not the cookie is valid and recent enough.
+ */
+bool syncookie_check(in_addr_t ip_addr, int port, uint32_t their_init_seqno,
+                     uint32_t cookie, int *opts);
+
+#endif /* CTCP_SYNCOOKIE_H */
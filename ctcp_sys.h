@@ -70,6 +70,33 @@ typedef struct ctcp_segment {
  */
 int conn_input(conn_t *conn, void *buf, size_t len);
 
+/** Input shared by several connections. Freed once the last one lets go. */
+typedef struct shared_buf {
+  int refs;              /* Number of holders */
+  size_t len;            /* Length of the data */
+  char data[];           /* The data, not to be changed */
+} shared_buf_t;
+
+/**
+ * Call on this, before conn_input(), to take input that goes to every
+ * connection. In broadcast mode (--broadcast), each chunk of STDIN is read
+ * once into a shared buffer and handed to all connections, and conn_input()
+ * only reports EOF. Keep the buffer instead of copying it, and let go of it
+ * with shared_buf_release() once it is no longer needed.
+ *
+ * conn: Connection object to identify the eventual destination of this input.
+ * buf: Return parameter. The buffer holding the input.
+ * returns: The number of bytes in the buffer, or 0 if there is none.
+ */
+int conn_input_shared(conn_t *conn, shared_buf_t **buf);
+
+/**
+ * Lets go of a shared buffer, freeing it if nothing else holds it.
+ *
+ * buf: The buffer, or NULL.
+ */
+void shared_buf_release(shared_buf_t *buf);
+
 /**
  * Call on this to send a cTCP segment to a destination associated with the
  * provided connection object.
@@ -129,6 +156,85 @@ size_t conn_bufspace(conn_t *conn);
  */
 void conn_remove(conn_t *conn);
 
+/** Categories of memory held by a connection, for accounting. */
+typedef enum mem_category {
+  MEM_TX,                /* Input waiting to be sent or acknowledged */
+  MEM_RX,                /* Received data waiting to be output */
+  MEM_OUT_QUEUE,         /* Output queued for STDOUT or the program */
+  MEM_IMPAIR,            /* Segment copies made to simulate unreliability */
+  MEM_NUM_CATEGORIES
+} mem_category_t;
+
+/** How close a connection is to its memory limits. */
+typedef enum mem_pressure {
+  MEM_PRESSURE_NONE,     /* Below the soft limit */
+  MEM_PRESSURE_SOFT,     /* Above the soft limit: stop taking in more input
+                            and shrink the advertised window */
+  MEM_PRESSURE_HARD      /* Above the hard limit: refuse to buffer more */
+} mem_pressure_t;
+
+/**
+ * Accounts for memory allocated (or freed, if bytes is negative) on behalf of
+ * a connection. Once a connection goes above the soft limit (--mem-soft), no
+ * more input is read for it until it drops back below.
+ *
+ * conn: The connection object.
+ * category: What the memory is used for.
+ * bytes: Number of bytes allocated, or negative number of bytes freed.
+ */
+void conn_mem_charge(conn_t *conn, mem_category_t category, long bytes);
+
+/**
+ * Returns how close a connection is to its memory limits.
+ *
+ * conn: The connection object.
+ */
+mem_pressure_t conn_mem_pressure(conn_t *conn);
+
+/**
+ * Stops or resumes reading input for a connection because its input waits
+ * too long to be sent. Input is not read while the connection is above its
+ * memory limits either, whatever this says.
+ *
+ * conn: The connection object.
+ * hold: Whether to stop (true) or resume (false) reading.
+ */
+void conn_hold_input(conn_t *conn, bool hold);
+
+/**
+ * Returns a number identifying this connection, unique within this process.
+ * Used to tag trace records and statistics.
+ *
+ * conn: The connection object.
+ */
+uint32_t conn_id(conn_t *conn);
+
+/**
+ * Remembers what a connection learned about the path to the other host, for
+ * the next connection to the same host. Call this when the connection ends.
+ * Does nothing unless the metrics cache is turned on.
+ *
+ * conn: The connection object.
+ * srtt: Smoothed round-trip time, in us.
+ * rttvar: Round-trip time variation, in us.
+ * cwnd: Congestion window, in bytes.
+ * ssthresh: Slow start threshold, in bytes. 0 if there was no loss.
+ */
+void conn_save_metrics(conn_t *conn, long srtt, long rttvar, uint32_t cwnd,
+                       uint32_t ssthresh);
+
+/** Streams multiplexed in a connection. Definition can be found in
+    ctcp_mux.c. */
+typedef struct mux mux_t;
+
+/**
+ * Returns the streams multiplexed in a connection.
+ *
+ * conn: The connection object.
+ * returns: The streams, or NULL if the connection is not multiplexed.
+ */
+mux_t *conn_mux(conn_t *conn);
+
 
 /** Whether or not the tester's debugging is turned on. You can ignore this. */
 bool test_debug_on;
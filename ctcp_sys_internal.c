@@ -12,13 +12,26 @@
 
 #include <errno.h>
 #include <poll.h>
-#include <pthread.h>
 #include <stddef.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "ctcp_sys_internal.h"
+#include "ctcp_codel.h"
+#include "ctcp_compress.h"
+#include "ctcp_fastopen.h"
+#include "ctcp_metrics.h"
+#include "ctcp_msg.h"
+#include "ctcp_mux.h"
+#include "ctcp_perf.h"
+#include "ctcp_prof.h"
+#include "ctcp_ratelimit.h"
+#include "ctcp_stats.h"
+#include "ctcp_stripe.h"
 #include "ctcp_sys.h"
+#include "ctcp_syncookie.h"
+#include "ctcp_trace.h"
+#include "ctcp_wheel.h"
 
 #define ASSERT_CLIENT_ONLY (assert(!SERVER))
 #define ASSERT_SERVER_ONLY (assert(SERVER))
@@ -55,6 +68,26 @@ static bool unix_socket = true;
 /** Whether or not the server runs a program. */
 static bool run_program = false;
 
+/** Whether or not the server sends its STDIN to every client, instead of the
+    most recently connected one. */
+static bool broadcast = false;
+
+/** Where the output of each client goes, with %u for the connection number,
+    or NULL for STDOUT. Either "file:path" or "unix:path". */
+static char *sink_pattern = NULL;
+
+/** Whether or not this client carries one part of a striped transfer. Its
+    input is passed on as is. */
+static bool striped = false;
+
+/** Files or FIFOs sent as streams 1 and up, and the polls for them. */
+static char *stream_files[MUX_MAX_STREAMS - 1];
+static int num_stream_files = 0;
+static struct pollfd *stream_polls[MUX_MAX_STREAMS - 1];
+
+/** Signal that interrupted or terminated the program, 0 if none yet. */
+static volatile sig_atomic_t exit_signal = 0;
+
 /** Options for unreliable communications. */
 static int seed = 144;
 static int opt_drop = false;
@@ -88,10 +121,39 @@ static struct timespec last_timeout;
 /** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
 static int num_connected = 0;
 
-/** Main thread and thread for sending rests. */
-static pthread_t thread_main;
-static pthread_t thread_resets;
-static bool handling_resets = false;
+/** Number given to the last connection added. */
+static uint32_t last_conn_id = 0;
+
+/** Memory limits for each connection, in bytes. 0 if there is no limit. */
+static size_t mem_soft_limit = 0;
+static size_t mem_hard_limit = 0;
+
+/** Memory above which no more input is read for a connection, 0 if there is
+    no limit. The soft limit, but at most half the hard limit. */
+static size_t mem_input_limit = 0;
+
+/** Handshakes completed while all connection slots were taken, oldest
+    first. */
+static pending_conn_t backlog[ACCEPT_BACKLOG];
+static int backlog_len = 0;
+
+/** Recently closed connections. An entry is free once it has expired. */
+static time_wait_t time_wait[TIME_WAIT_SIZE];
+
+/** Class of new connections, and the bytes a connection of the normal class
+    may send before it is moved to the bulk class (0 for never). */
+static prio_class_t default_prio = PRIO_NORMAL;
+static uint32_t bulk_after = 0;
+
+/** Segments waiting for room in the socket, by class. */
+static queued_pkt_t *send_queue[PRIO_NUM_CLASSES];
+static queued_pkt_t *send_queue_tail[PRIO_NUM_CLASSES];
+static int send_queue_len[PRIO_NUM_CLASSES];
+
+/** Names of the memory categories, for printing. */
+static const char *mem_category_names[MEM_NUM_CATEGORIES] = {
+  "tx", "rx", "out_queue", "impairment"
+};
 
 
 /////////////////////////////// HELPER FUNCTIONS //////////////////////////////
@@ -148,13 +210,6 @@ int do_config(char *port) {
   config->socket = s;
   config->connections = NULL;
 
-  /* Set up receive timeout. */
-  struct timeval tv;
-  tv.tv_sec = CONN_TIMEOUT;
-  tv.tv_usec = 0;
-  setsockopt(config->socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv,
-             sizeof(struct timeval));
-
   /* Bind socket to port/name so host receives only relevant messages. */
   struct sockaddr *addr;
   size_t size;
@@ -181,19 +236,8 @@ int do_config(char *port) {
     return -1;
   }
 
-  /* Handle if previous connection(s) have not ended. Send RSTs to those
-     hosts in a different thread. First create the reset thread. */
-  thread_main = pthread_self();
-  pthread_create(&thread_resets, NULL, send_resets, NULL);
-
-  /* Wait for a bit. If still handling resets, wait. */
-  sleep(RESET_THREAD_DURATION);
-  while (handling_resets);
-
-  /* Kill the thread. */
-  pthread_cancel(thread_resets);
-  pthread_join(thread_resets, NULL);
-  fprintf(stderr, "done!\n");
+  /* Packets from previous connection(s) that have not ended are absorbed or
+     reset as they come in (see recv_filter). */
   return 0;
 }
 
@@ -386,6 +430,8 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   tcp_hdr->th_ack = htonl(ntohl(segment->ackno) + dst->their_init_seqno);
   tcp_hdr->th_off = TCP_HDR_SIZE / 4;
   tcp_hdr->th_flags = segment->flags;
+  dst->last_seqno = ntohl(tcp_hdr->th_seq);
+  dst->last_ackno = ntohl(tcp_hdr->th_ack);
 
   /* Need to add ACK to all segments if sending it to the web. */
   if (!run_program && !unix_socket)
@@ -409,6 +455,62 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   return datagram;
 }
 
+/**
+ * Puts a connection that is being freed in TIME_WAIT. If all entries are in
+ * use, the one that expires first is replaced.
+ *
+ * conn: The connection being freed.
+ */
+void time_wait_add(conn_t *conn) {
+  time_wait_t *tw = &time_wait[0];
+  int i;
+  for (i = 1; i < TIME_WAIT_SIZE; i++) {
+    if (time_wait[i].expires < tw->expires)
+      tw = &time_wait[i];
+  }
+
+  tw->ip_addr = conn->ip_addr;
+  tw->port = conn->port;
+  tw->their_init_seqno = conn->their_init_seqno;
+  tw->seqno = conn->last_seqno;
+  tw->ackno = conn->last_ackno;
+  tw->expires = current_time() + TIME_WAIT_INTERVAL;
+}
+
+/**
+ * Absorbs a segment of a connection in TIME_WAIT. A FIN is acknowledged again,
+ * since the other host only retransmits it if our last ACK was lost.
+ *
+ * pkt: The IP packet received.
+ * returns: Whether or not the segment belongs to a connection in TIME_WAIT.
+ */
+bool time_wait_absorb(char *pkt) {
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  long now = current_time();
+
+  int i;
+  for (i = 0; i < TIME_WAIT_SIZE; i++) {
+    time_wait_t *tw = &time_wait[i];
+    if (tw->expires <= now || tw->port != ntohs(tcp_hdr->th_sport) ||
+        (!unix_socket && tw->ip_addr != ip_hdr->saddr) ||
+        ntohl(tcp_hdr->th_seq) < tw->their_init_seqno ||
+        ntohl(tcp_hdr->th_seq) > tw->ackno)
+      continue;
+
+    if (tcp_hdr->th_flags & TH_FIN) {
+      conn_t conn;
+      memset((void *) &conn, 0, sizeof(conn_t));
+      conn_setup(&conn, tw->ip_addr, tw->port, unix_socket);
+      conn.next_seqno = tw->seqno;
+      conn.ackno = tw->ackno;
+      send_ack(&conn);
+    }
+    return true;
+  }
+  return false;
+}
+
 /**
  * Naive filtering. Host might receive many unwanted packets or leftover
  * packets from a previous session. We drop these packets.
@@ -437,10 +539,24 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   if (tcp_hdr->th_dport != htons(config->port))
     return 0;
 
-  /* A RST packet. End connection. */
+  /* A RST packet. End connection. A server only ends the connection of the
+     client that sent it. */
   if (tcp_hdr->th_flags & TH_RST) {
-    fprintf(stderr, "[ERROR] Server sent a RST! Closing connection.\n");
-    exit(EXIT_FAILURE);
+    if (!SERVER) {
+      fprintf(stderr, "[ERROR] Server sent a RST! Closing connection.\n");
+      exit(EXIT_FAILURE);
+    }
+    conn_t *conn;
+    for (conn = get_connections(); conn != NULL; conn = conn->next) {
+      if (conn->port == ntohs(tcp_hdr->th_sport) &&
+          (unix_socket || conn->ip_addr == ip_hdr->saddr) &&
+          conn->state != NULL && !conn->delete_me) {
+        fprintf(stderr, "[ERROR] Client sent a RST! Closing connection.\n");
+        ctcp_destroy(conn->state);
+        break;
+      }
+    }
+    return 0;
   }
 
   /* Otherwise a SYN or SYN-ACK? */
@@ -465,6 +581,22 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
     conn = conn->next;
   }
 
+  /* Segment of a connection that just closed. Checked first, since a late
+     copy of the first data segment would carry a valid SYN cookie. */
+  if (time_wait_absorb(buf))
+    return 0;
+
+  /* Segment completing a handshake answered with a SYN cookie. */
+  if (SERVER && tcp_cookie_ack(buf, &conn)) {
+    if (conn == NULL)
+      return 0;
+    if (rconn != NULL)
+      *rconn = conn;
+    return r;
+  }
+
+  /* Leftover packet from a previous session. */
+  send_reset(buf);
   return 0;
 }
 
@@ -480,63 +612,122 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
  * returns: Number of bytes actually sent, or -1 if error.
  */
 int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
-  struct sockaddr *addr;
-  size_t size;
+  queued_pkt_t pkt;
+  pkt.addr_len = conn_dest(dst, &pkt);
+  return sendto(config->socket, buf, len, flags, (struct sockaddr *) &pkt.addr,
+                pkt.addr_len);
+}
 
+/**
+ * Fills in the address to send a connection's packets to.
+ *
+ * dst: Destination connection object.
+ * pkt: The packet to fill in the address of.
+ *
+ * returns: Length of the address.
+ */
+socklen_t conn_dest(conn_t *dst, queued_pkt_t *pkt) {
   /* Get the correct socket. */
   if (unix_socket) {
-    addr = (struct sockaddr *) &dst->sunaddr;
-    size = sizeof(dst->sunaddr);
+    conn_sunaddr(dst, &pkt->addr.un);
+    return sizeof(pkt->addr.un);
   }
-  else {
-    addr = (struct sockaddr *) &dst->saddr;
-    size = sizeof(dst->saddr);
-  }
-
-  return sendto(config->socket, buf, len, flags, addr, size);
+  pkt->addr.in = dst->saddr;
+  return sizeof(pkt->addr.in);
 }
 
 /**
- * Send resets to previous connections, if they exist. We can tell if there are
- * lots of RSTs or ACKs being sent to us.
+ * Sends a packet, or queues it if segments of its class or a higher one are
+ * still waiting, or if the socket is full. Lower classes are passed by.
+ *
+ * dst: Destination connection object.
+ * prio: Class of the packet.
+ * buf: Packet to send.
+ * len: Length of the packet.
+ *
+ * returns: len if the packet was sent or queued, -1 if it was dropped.
  */
-void *send_resets(void *args) {
-  fprintf(stderr, "[INFO] Cleaning up old connections... ");
-  char buf[MAX_PACKET_SIZE];
-  memset(buf, 0, MAX_PACKET_SIZE);
-  int r;
-
-  /* See if there are leftover packets. If so, send resets to them. */
-  r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
-  while (r > 0) {
-    handling_resets = true;
-
-    iphdr_t *ip_hdr = (iphdr_t *) buf;
-    tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-    char *rst = create_tcp_rst(ip_hdr->saddr, tcp_hdr->th_dport,
-                               tcp_hdr->th_sport, tcp_hdr->th_ack);
+int send_prio(conn_t *dst, prio_class_t prio, const void *buf, size_t len) {
+  int i;
+  for (i = 0; i <= prio && send_queue[i] == NULL; i++)
+    ;
+
+  /* Nothing ahead of it. Try to send it right away. */
+  if (i > prio) {
+    int n = send_pkt(dst, config->socket, buf, len, 0);
+    if (n >= 0 || (errno != EAGAIN && errno != ENOBUFS))
+      return n;
+  }
+  if (send_queue_len[prio] >= SEND_QUEUE_MAX)
+    return -1;
 
-    /* Create connection object to send resets to. */
-    conn_t conn;
-    memset((void *) &conn, 0, sizeof(conn_t));
-    conn_setup(&conn, ip_hdr->saddr, ntohs(tcp_hdr->th_sport), false);
+  queued_pkt_t *pkt = malloc(sizeof(queued_pkt_t) + len);
+  pkt->next = NULL;
+  pkt->addr_len = conn_dest(dst, pkt);
+  pkt->len = len;
+  memcpy(pkt->buf, buf, len);
 
-    int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
-                   (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
-    memset(buf, 0, MAX_PACKET_SIZE);
-    free(rst);
+  if (send_queue[prio] == NULL)
+    send_queue[prio] = pkt;
+  else
+    send_queue_tail[prio]->next = pkt;
+  send_queue_tail[prio] = pkt;
+  send_queue_len[prio]++;
 
-    /* Could not send resets. Give up. */
-    if (s < 0)
-      break;
+  /* Send it once there is room. */
+  events[2].events |= POLLOUT;
+  return len;
+}
 
-    /* Continue checking for more packets to send resets to. */
-    handling_resets = false;
-    r = recv(config->socket, buf, MAX_PACKET_SIZE, 0);
+/**
+ * Sends queued packets, highest class first, until the socket is full.
+ */
+void send_queue_flush() {
+  int prio;
+  queued_pkt_t *pkt;
+
+  for (prio = 0; prio < PRIO_NUM_CLASSES; prio++) {
+    while ((pkt = send_queue[prio]) != NULL) {
+      if (sendto(config->socket, pkt->buf, pkt->len, 0,
+                 (struct sockaddr *) &pkt->addr, pkt->addr_len) < 0 &&
+          (errno == EAGAIN || errno == ENOBUFS))
+        return;
+      send_queue[prio] = pkt->next;
+      send_queue_len[prio]--;
+      free(pkt);
+    }
   }
+  events[2].events &= ~POLLOUT;
+}
 
-  handling_resets = false;
-  return NULL;
+/**
+ * Sends a reset in response to a packet from a previous session. Resets can
+ * only be sent over a raw socket; over a Unix socket the packet is just
+ * dropped.
+ *
+ * pkt: The IP packet received.
+ * returns: -1 if the reset could not be sent, 0 otherwise.
+ */
+int send_reset(char *pkt) {
+  if (unix_socket)
+    return 0;
+
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  if (tcp_hdr->th_flags & TH_RST)
+    return 0;
+  char *rst = create_tcp_rst(ip_hdr->saddr, tcp_hdr->th_dport,
+                             tcp_hdr->th_sport, tcp_hdr->th_ack);
+
+  /* Create connection object to send resets to. */
+  conn_t conn;
+  memset((void *) &conn, 0, sizeof(conn_t));
+  conn_setup(&conn, ip_hdr->saddr, ntohs(tcp_hdr->th_sport), false);
+
+  int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
+                 (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
+  free(rst);
+  return s < 0 ? -1 : 0;
 }
 
 /**
@@ -558,6 +749,55 @@ int send_tcp_conn_seg(conn_t *dst, int flags) {
   }
   return 0;
 }
+
+/**
+ * Sends a SYN or SYN-ACK with a fast-open block at the start of its payload,
+ * followed by data if there is any. The sequence numbers are not advanced for
+ * the data; the handshake takes care of that once it is acknowledged.
+ *
+ * dst: A conn_t object associated with the destination.
+ * flags: TCP flags.
+ * cookie: The cookie to send, or NULL to ask for one.
+ * data: Data to send with the SYN, or NULL.
+ * len: Length of the data.
+ *
+ * returns: -1 if error, 0 otherwise.
+ */
+int send_fastopen_seg(conn_t *dst, int flags, const uint8_t *cookie,
+                      const char *data, uint16_t len) {
+  char payload[FASTOPEN_OPT_LEN + MAX_SEG_DATA_SIZE];
+  uint16_t opt_len = fastopen_build((fastopen_opt_t *) payload, cookie);
+  if (len > 0)
+    memcpy(payload + opt_len, data, len);
+
+  char *tcp_pkt = create_tcp_seg(dst, flags, payload, opt_len + len);
+  dst->next_seqno = dst->seqno;
+  int r = send_pkt(dst, config->socket, tcp_pkt,
+                   FULL_HDR_SIZE + opt_len + len, 0);
+  free(tcp_pkt);
+  return r < 0 ? -1 : 0;
+}
+
+/**
+ * Sends a SYN or SYN-ACK with a compression block as its payload, to ask for
+ * compression or to agree to it. The sequence numbers are not advanced for
+ * the block.
+ *
+ * dst: A conn_t object associated with the destination.
+ * flags: TCP flags.
+ *
+ * returns: -1 if error, 0 otherwise.
+ */
+int send_compress_seg(conn_t *dst, int flags) {
+  compress_opt_t opt;
+  uint16_t opt_len = compress_build(&opt);
+
+  char *tcp_pkt = create_tcp_seg(dst, flags, (char *) &opt, opt_len);
+  dst->next_seqno = dst->seqno;
+  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE + opt_len, 0);
+  free(tcp_pkt);
+  return r < 0 ? -1 : 0;
+}
 inline int send_ack(conn_t *dst) {
   return send_tcp_conn_seg(dst, TH_ACK);
 }
@@ -565,15 +805,38 @@ inline int send_rst(conn_t *dst) {
   return send_tcp_conn_seg(dst, TH_RST);
 }
 inline int send_syn(conn_t *dst) {
+  if (compress_enabled)
+    return send_compress_seg(dst, TH_SYN);
   return send_tcp_conn_seg(dst, TH_SYN);
 }
 inline int send_synack(conn_t *dst) {
+  /* Hand out a fast-open cookie if the client asked for one. */
+  if (dst->fastopen) {
+    uint8_t cookie[FASTOPEN_COOKIE_LEN];
+    fastopen_cookie(dst->ip_addr, cookie);
+    return send_fastopen_seg(dst, TH_SYN | TH_ACK, cookie, NULL, 0);
+  }
+  if (dst->compressed)
+    return send_compress_seg(dst, TH_SYN | TH_ACK);
   return send_tcp_conn_seg(dst, TH_SYN | TH_ACK);
 }
 
 
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
+/**
+ * Polls STDIN unless the connection it goes to is not reading input. On a
+ * server that is the newest connection, the others do not get STDIN, so
+ * they have no say.
+ */
+static void stdin_poll() {
+  conn_t *conn = get_connections();
+  if (conn != NULL && conn->input_throttled)
+    events[STDIN_FILENO].events &= ~POLLIN;
+  else
+    events[STDIN_FILENO].events |= POLLIN;
+}
+
 /**
  * Add to the conn_t list.
  *
@@ -581,21 +844,43 @@ inline int send_synack(conn_t *dst) {
  * conn: The new conn_t to add.
  */
 void conn_add(conn_t *conn) {
-  conn_t *conn_list = get_connections();
+  conn_t **conn_list = SERVER ? &config->connections : &config->sconn;
 
-  if (conn != conn_list) {
-    conn->prev = &conn_list;
-    conn->next = conn_list;
+  conn->prev = conn_list;
+  if (conn != *conn_list) {
+    conn->next = *conn_list;
 
-    if (conn_list)
-      conn_list->prev = &conn->next;
+    if (*conn_list)
+      (*conn_list)->prev = &conn->next;
   }
+  conn->id = ++last_conn_id;
   conn->out_queue_tail = &conn->out_queue;
+  conn->deficit = DRR_QUANTUM;
+  conn->prio = default_prio;
+  conn->out_fd = STDOUT_FILENO;
+  conn->out_poll = &events[STDOUT_FILENO];
+
+  /* Memory is only accounted for if it is limited or reported. */
+  if (mem_soft_limit || mem_hard_limit || DEBUG)
+    conn->mem = calloc(sizeof(mem_account_t), 1);
+  if (SERVER && stripe_server)
+    conn->stripe = stripe_member_new();
+
+  if (msg_enabled)
+    conn->msg = msg_new();
+
+  /* Stream 0 is STDIN, or the program once it runs. */
+  if (mux_enabled) {
+    conn->mux = mux_new(conn->id);
+    if (!run_program)
+      mux_add_input(conn->mux, 0, STDIN_FILENO, &events[STDIN_FILENO]);
+  }
 
-  if (SERVER)
-    config->connections = conn;
-  else
-    config->sconn = conn;
+  *conn_list = conn;
+
+  /* STDIN now goes to this connection. */
+  if (!broadcast && !run_program)
+    stdin_poll();
 }
 
 /**
@@ -609,6 +894,17 @@ size_t conn_bufspace(conn_t *conn) {
   chunk_t *chunk;
   size_t used = 0;
 
+  /* Don't buffer more output for a connection above its hard limit. What
+     it received can still be written out while nothing is queued, or it
+     would never get back below the limit. */
+  if (conn_mem_pressure(conn) == MEM_PRESSURE_HARD && conn->out_queue != NULL)
+    return 0;
+
+  /* Don't take chunks too far ahead of the one a striped transfer waits
+     for. */
+  if (conn->stripe != NULL && !stripe_room(conn->stripe))
+    return 0;
+
   /* Count up how much output space already used. */
   for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
     used += (chunk->size - chunk->used);
@@ -616,6 +912,25 @@ size_t conn_bufspace(conn_t *conn) {
   return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
 }
 
+/**
+ * Closes the output of a connection once EOF was written and everything
+ * before it is out, so the program or sink reading it sees the end. STDOUT is
+ * shared by the connections and stays open.
+ *
+ * conn: Associated connection object.
+ */
+static void conn_close_output(conn_t *conn) {
+  if (conn->out_queue != NULL || conn->out_fd < 0 ||
+      conn->out_fd == STDOUT_FILENO || conn->stripe != NULL)
+    return;
+
+  close(conn->out_fd);
+  if (run_program)
+    conn->stdin = -1;
+  conn->out_fd = -1;
+  conn->out_poll->fd = -1;
+}
+
 /**
  * Drain the output queue.
  *
@@ -625,20 +940,18 @@ void conn_drain(conn_t *conn) {
   chunk_t *chunk;
   int w;
   bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
 
   /* Already wrote an error, can't write anymore. */
   if (conn->wrote_err)
     return;
 
-  /* Drain the output queue. Output as many chunks as possible. */
+  /* Drain the output queue. Output as many chunks as possible, up to the
+     connection's share of this pass through the event loop. */
   while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
+    if (conn->deficit <= 0)
+      break;
+    w = write(conn->out_fd, chunk->buf + chunk->used,
+              chunk->size - chunk->used);
 
     if (w < 0) {
       if (errno != EAGAIN)
@@ -647,36 +960,174 @@ void conn_drain(conn_t *conn) {
     }
     outputted = true;
     chunk->used += w;
+    conn->deficit -= w;
 
     /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
+    if (chunk->used < chunk->size)
       break;
-    }
     conn->out_queue = chunk->next;
 
     /* Update pointers. */
     if (!conn->out_queue)
       conn->out_queue_tail = &conn->out_queue;
+    conn_mem_charge(conn, MEM_OUT_QUEUE,
+                    -(long) offsetof(chunk_t, buf[chunk->size]));
     free(chunk);
   }
 
+  /* Output left over. Drain it once there is room. */
+  if (conn->out_queue && !conn->wrote_err)
+    conn->out_poll->events |= POLLOUT;
+
   /* Error in outputting if already wrote EOF but still stuff in the output
      queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
+  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue) {
     conn->wrote_err = true;
+    conn_close_output(conn);
+  }
 
   /* Output queue has space. Call student code. */
   if (outputted && !conn->delete_me)
     ctcp_output(conn->state);
 }
 
+/**
+ * [Server-only]
+ * Polls STDIN in broadcast mode unless some connection is not reading input,
+ * so the slowest connection sets the pace and none is left behind.
+ */
+static void broadcast_poll() {
+  conn_t *conn;
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    if (conn->input_throttled && !conn->delete_me)
+      break;
+  }
+
+  if (conn != NULL)
+    events[STDIN_FILENO].events &= ~POLLIN;
+  else
+    events[STDIN_FILENO].events |= POLLIN;
+}
+
+/**
+ * Stops or resumes polling for input to be sent on a connection, for one
+ * reason. Polling resumes once no reason is left.
+ *
+ * conn: The connection object.
+ * reason: Why input is stopped.
+ * throttle: Whether to stop (true) or resume (false) polling.
+ */
+void conn_throttle_input(conn_t *conn, throttle_reason_t reason,
+                         bool throttle) {
+  struct pollfd *input = conn->poll_fd;
+  if (throttle)
+    conn->input_throttled |= reason;
+  else
+    conn->input_throttled &= ~reason;
+  if (conn->mux != NULL)
+    mux_poll_input(conn->mux, !conn->input_throttled);
+  if (broadcast)
+    broadcast_poll();
+  else if (!run_program)
+    stdin_poll();
+  else if (input == NULL)
+    return;
+  else if (conn->input_throttled)
+    input->events &= ~POLLIN;
+  else
+    input->events |= POLLIN;
+}
+
+/**
+ * Stops or resumes reading input for a connection because its input waits
+ * too long to be sent.
+ *
+ * conn: The connection object.
+ * hold: Whether to stop (true) or resume (false) reading.
+ */
+void conn_hold_input(conn_t *conn, bool hold) {
+  conn_throttle_input(conn, THROTTLE_QUEUE, hold);
+}
+
+/**
+ * Accounts for memory allocated or freed on behalf of a connection. Stops
+ * reading input for the connection while it is above the soft limit, or
+ * half the hard limit.
+ *
+ * conn: The connection object.
+ * category: What the memory is used for.
+ * bytes: Number of bytes allocated, or negative number of bytes freed.
+ */
+void conn_mem_charge(conn_t *conn, mem_category_t category, long bytes) {
+  mem_account_t *mem = conn->mem;
+  if (mem == NULL)
+    return;
+
+  mem->used[category] += bytes;
+  mem->total += bytes;
+  if (mem->used[category] > mem->high[category])
+    mem->high[category] = mem->used[category];
+  if (mem->total > mem->total_high)
+    mem->total_high = mem->total;
+
+  /* Backpressure on the input side. */
+  if (mem_input_limit == 0)
+    return;
+  bool throttled = conn->input_throttled & THROTTLE_MEMORY;
+  if (!throttled && mem->total > mem_input_limit)
+    conn_throttle_input(conn, THROTTLE_MEMORY, true);
+  else if (throttled && mem->total <= mem_input_limit)
+    conn_throttle_input(conn, THROTTLE_MEMORY, false);
+}
+
+/**
+ * Returns how close a connection is to its memory limits.
+ *
+ * conn: The connection object.
+ */
+mem_pressure_t conn_mem_pressure(conn_t *conn) {
+  if (conn->mem == NULL)
+    return MEM_PRESSURE_NONE;
+  if (mem_hard_limit && conn->mem->total >= mem_hard_limit)
+    return MEM_PRESSURE_HARD;
+  if (mem_soft_limit && conn->mem->total > mem_soft_limit)
+    return MEM_PRESSURE_SOFT;
+  return MEM_PRESSURE_NONE;
+}
+
+/**
+ * Prints out the memory high-water marks of a connection.
+ *
+ * conn: The connection object.
+ */
+void conn_mem_report(conn_t *conn) {
+  int i;
+  fprintf(stderr, "[INFO] Connection %u memory high-water marks:", conn->id);
+  for (i = 0; i < MEM_NUM_CATEGORIES; i++)
+    fprintf(stderr, " %s %zu,", mem_category_names[i], conn->mem->high[i]);
+  fprintf(stderr, " total %zu bytes\n", conn->mem->total_high);
+}
+
 /**
  * Removes a connection object from the conn_t list.
  *
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
+  if (conn->mem != NULL)
+    conn_mem_report(conn);
+
+  /* Absorb segments still on their way once the connection is gone. */
+  if (conn->state != NULL)
+    time_wait_add(conn);
+
+  /* Free up the slot for another client. */
+  if (SERVER) {
+    num_connected--;
+    if (conn->poll_fd != NULL)
+      conn->poll_fd->fd = -1;
+  }
+
   /* Free up chunks. */
   chunk_t *chunk, *next_chunk;
   for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
@@ -684,27 +1135,135 @@ void conn_free(conn_t *conn) {
     free(chunk);
   }
 
-  /* Adjust pointers. */
+  /* Adjust pointers. The first connection's prev points at the head of the
+     list, so removing it leaves the others in place. */
   if (conn->next)
     conn->next->prev = conn->prev;
   if (conn->prev)
     *conn->prev = conn->next;
 
-  if (conn == get_connections()) {
-    if (SERVER)
-      config->connections = NULL;
-    else
-      config->sconn = NULL;
-  }
+  /* It may have been the one holding up the others, or the one STDIN went
+     to. */
+  if (broadcast)
+    broadcast_poll();
+  else if (!run_program)
+    stdin_poll();
 
-  /* Close pipes to program, if it's running. */
+  /* Close pipes to program, if it's running, or the connection's own output
+     sink. */
   if (run_program) {
     close(conn->stdin);
     close(conn->stdout);
   }
+  else if (conn->out_fd != STDOUT_FILENO && conn->out_fd >= 0) {
+    close(conn->out_fd);
+  }
+  if (conn->out_poll != &events[STDOUT_FILENO])
+    conn->out_poll->fd = -1;
+  if (conn->hs != NULL)
+    free(conn->hs->syn_data);
+  free(conn->hs);
+  free(conn->mem);
+  if (conn->stripe != NULL)
+    stripe_member_free(conn->stripe);
+  if (conn->mux != NULL)
+    mux_free(conn->mux);
+  if (conn->msg != NULL)
+    msg_free(conn->msg);
+  if (conn->compress != NULL)
+    compress_free(conn->compress);
   free(conn);
 }
 
+/**
+ * Returns the number identifying this connection within this process.
+ *
+ * conn: The connection object.
+ */
+uint32_t conn_id(conn_t *conn) {
+  return conn->id;
+}
+
+/**
+ * Returns the streams multiplexed in a connection.
+ *
+ * conn: The connection object.
+ * returns: The streams, or NULL if the connection is not multiplexed.
+ */
+mux_t *conn_mux(conn_t *conn) {
+  return conn->mux;
+}
+
+/**
+ * Returns the address the metrics of a connection are kept under. Over Unix
+ * sockets every host is this one, whatever IP address the segments carry.
+ *
+ * conn: The connection.
+ */
+static in_addr_t conn_metrics_addr(conn_t *conn) {
+  return unix_socket ? 0 : conn->ip_addr;
+}
+
+void conn_save_metrics(conn_t *conn, long srtt, long rttvar, uint32_t cwnd,
+                       uint32_t ssthresh) {
+  metrics_t metrics;
+  if (srtt <= 0)
+    return;
+  metrics.srtt = srtt;
+  metrics.rttvar = rttvar;
+  metrics.cwnd = cwnd;
+  metrics.ssthresh = ssthresh;
+  metrics_put(conn_metrics_addr(conn), &metrics);
+}
+
+/**
+ * Makes the configuration handed to ctcp_init() for a new connection, seeded
+ * with what earlier connections to the same host learned, or else with the
+ * round-trip time of the handshake.
+ *
+ * conn: The new connection.
+ * returns: The configuration, to be freed by ctcp_init().
+ */
+static ctcp_config_t *conn_config(conn_t *conn) {
+  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+
+  metrics_t metrics;
+  if (metrics_get(conn_metrics_addr(conn), &metrics)) {
+    config_copy->srtt = metrics.srtt;
+    config_copy->rttvar = metrics.rttvar;
+    config_copy->cwnd = metrics.cwnd;
+    config_copy->ssthresh = metrics.ssthresh;
+  }
+  /* Same as a first RTT sample (RFC 6298). */
+  else if (conn->handshake_rtt > 0) {
+    config_copy->srtt = conn->handshake_rtt;
+    config_copy->rttvar = conn->handshake_rtt / 2;
+  }
+  return config_copy;
+}
+
+/**
+ * Reads from STDIN, adding network-line endings if needed.
+ *
+ * buf: Buffer to read into.
+ * len: Maximum number of bytes to read.
+ * returns: What read() returned.
+ */
+static int read_stdin(char *buf, size_t len) {
+  if (unix_socket || striped)
+    return read(STDIN_FILENO, buf, len);
+
+  int r = read(STDIN_FILENO, buf, len - 1);
+  if (r > 0) {
+    if (add_network_line_ending(!unix_socket, buf, r))
+      r += 1;
+    else
+      r += read(STDIN_FILENO, buf + r, 1);
+  }
+  return r;
+}
+
 /**
  * Reads input that then needs to be put into segments to send off. Reads up to
  * to len bytes.
@@ -725,31 +1284,104 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* Data sent with the SYN that the server did not take. Send it again. */
+  if (conn->hs != NULL && conn->hs->syn_data != NULL) {
+    handshake_t *hs = conn->hs;
+    r = conn->syn_data_len < len ? conn->syn_data_len : len;
+    memcpy(buf, hs->syn_data, r);
+    conn->syn_data_len -= r;
+    memmove(hs->syn_data, hs->syn_data + r, conn->syn_data_len);
+    if (conn->syn_data_len == 0) {
+      free(hs->syn_data);
+      hs->syn_data = NULL;
+      conn_handshake_done(conn);
+    }
+    return r;
+  }
+
   /* Already read EOF. */
   if (conn->read_eof) {
     return -1;
   }
 
+  /* STDIN is read once for every connection, see conn_input_shared(). */
+  if (broadcast)
+    return 0;
+
+  /* STDIN only goes to the newest connection of a server. The others have
+     no input of their own, apart from what they already took. */
+  if (SERVER && !run_program && conn != get_connections() &&
+      !(conn->msg != NULL && msg_held(conn->msg)) &&
+      !(conn->compress != NULL && compress_held(conn->compress))) {
+    conn->read_eof = true;
+    return -1;
+  }
+
+  /* Above the soft memory limit, input waiting too long to be sent, or used
+     up its share of this pass through the event loop. Leave the input where
+     it is for now. */
+  if (conn->input_throttled || conn->deficit <= 0)
+    return 0;
+
+  /* Multiplexed. Each call reads a segment from one of the streams. */
+  if (conn->mux != NULL) {
+    r = mux_input(conn->mux, buf, len);
+    if (r < 0)
+      conn->read_eof = true;
+    else
+      conn->deficit -= r;
+    return r;
+  }
+
+  /* Message mode. Only whole records are read, unless one is too large for
+     a segment. */
+  if (conn->msg != NULL) {
+    r = msg_input(conn->msg, run_program ? conn->stdout : STDIN_FILENO, buf,
+                  len);
+    if (r < 0) {
+      conn->read_eof = true;
+      struct pollfd *input = run_program ? conn->poll_fd : &events[STDIN_FILENO];
+      if (input != NULL)
+        input->fd = -1;
+      return -1;
+    }
+    PERF_ADD_BYTES(r);
+    conn->deficit -= r;
+    return r;
+  }
+
+  /* Compressed. The input is read a block at a time and compressed before
+     it is cut into segments. */
+  if (conn->compress != NULL) {
+    r = compress_input(conn->compress, run_program ? conn->stdout :
+                       STDIN_FILENO, buf, len);
+    if (r < 0) {
+      conn->read_eof = true;
+      struct pollfd *input = run_program ? conn->poll_fd : &events[STDIN_FILENO];
+      if (input != NULL)
+        input->fd = -1;
+      return -1;
+    }
+    PERF_ADD_BYTES(r);
+    conn->deficit -= r;
+    return r;
+  }
+
   /* Read from the appropriate place (STOUT of the associated program). */
   if (run_program)
     r = read(conn->stdout, buf, len);
-  else if (unix_socket)
-    r = read(STDIN_FILENO, buf, len);
-  /* Add network-line endings if needed. */
-  else {
-    r = read(STDIN_FILENO, buf, len - 1);
-    if (r > 0) {
-      if (add_network_line_ending(!unix_socket, buf, r))
-        r += 1;
-      else
-        r += read(STDIN_FILENO, buf + r, 1);
-    }
-  }
+  else
+    r = read_stdin(buf, len);
 
   /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
   if (r == 0 || (r < 0 && errno != EAGAIN) ||
       ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
     conn->read_eof = true;
+
+    /* The input hung up. Stop polling it, or poll() keeps reporting it. */
+    struct pollfd *input = run_program ? conn->poll_fd : &events[STDIN_FILENO];
+    if (r == 0 && input != NULL)
+      input->fd = -1;
     return -1;
   }
   /* No input. */
@@ -757,16 +1389,48 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     r = 0;
   }
 
+  PERF_ADD_BYTES(r);
+  conn->deficit -= r;
   return r;
 }
 
 /**
- * Schedules a connection object for removal.
+ * Takes the broadcast input handed to a connection, if it did not take it
+ * yet.
  *
- * conn: The conn_t to remove.
+ * conn: Connection object to identify the eventual destination of this input.
+ * buf: Return parameter. The buffer holding the input.
+ * returns: The number of bytes in the buffer, or 0 if there is none.
  */
-void conn_remove(conn_t *conn) {
-  conn->delete_me = true;
+int conn_input_shared(conn_t *conn, shared_buf_t **buf) { ASSERT_CONN;
+  shared_buf_t *shared = conn->broadcast;
+  if (shared == NULL)
+    return 0;
+
+  shared->refs++;
+  conn->broadcast = NULL;
+  conn->deficit -= shared->len;
+  *buf = shared;
+  return shared->len;
+}
+
+/**
+ * Lets go of a shared buffer, freeing it if nothing else holds it.
+ *
+ * buf: The buffer, or NULL.
+ */
+void shared_buf_release(shared_buf_t *buf) {
+  if (buf != NULL && --buf->refs == 0)
+    free(buf);
+}
+
+/**
+ * Schedules a connection object for removal.
+ *
+ * conn: The conn_t to remove.
+ */
+void conn_remove(conn_t *conn) {
+  conn->delete_me = true;
 
   /* Log to tester that this connection has been removed (as a result to a call
      to ctcp_destroy). */
@@ -793,9 +1457,24 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* Control segments and resent data go first, new data goes by the class of
+     the connection. A connection that sent a lot is moved to the bulk
+     class. */
+  uint16_t seg_data_len = len - sizeof(ctcp_segment_t);
+  uint32_t seg_end = ntohl(segment->seqno) + seg_data_len;
+  prio_class_t prio = conn->prio;
+  if (seg_data_len == 0 || seg_end <= conn->sent_seqno)
+    prio = PRIO_CONTROL;
+  else {
+    conn->sent_seqno = seg_end;
+    if (bulk_after > 0 && conn->prio == PRIO_NORMAL && seg_end > bulk_after)
+      conn->prio = PRIO_BULK;
+  }
+
   /* Make a copy of the segment first. */
   ctcp_segment_t *segment_copy = calloc(len, 1);
   memcpy(segment_copy, segment, len);
+  conn_mem_charge(conn, MEM_IMPAIR, len);
 
   /* Fork process off in order to do unreliability. Keep track of whether we
      are forked or not. */
@@ -811,6 +1490,7 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
       fprintf(stderr, "[DEBUG] Dropping segment\n");
       print_hdr_ctcp(segment_copy);
     }
+    conn_mem_charge(conn, MEM_IMPAIR, -(long) len);
     free(segment_copy);
     return len;
   }
@@ -848,6 +1528,7 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     }
     /* Original process. */
     else {
+      conn_mem_charge(conn, MEM_IMPAIR, -(long) len);
       free(segment_copy);
       return len;
     }
@@ -880,13 +1561,21 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
   }
 
   /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  char *pkt;
+  PROF_CALL(PROF_CONVERT_TO_DATAGRAM, conn->id,
+            pkt = convert_to_datagram(conn, segment_copy, len));
+  /* A forked process only sends its own segment, not the ones queued. */
+  int n;
+  if (am_i_forked)
+    n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  else
+    n = send_prio(conn, prio, pkt, total_len);
   if (DEBUG) {
     fprintf(stderr, "[DEBUG] Sent segment\n");
     print_hdr_ctcp(segment_copy);
   }
   free(pkt);
+  conn_mem_charge(conn, MEM_IMPAIR, -(long) len);
   free(segment_copy);
 
   /* Kill forked process. */
@@ -901,45 +1590,22 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 }
 
 /**
- * Writes a buffer to STDOUT or the program associated with this connection.
- * If called with a length of 0, an EOF is recorded.
+ * Writes a buffer to the connection's output, queueing what it does not take
+ * right away.
  *
  * conn: The associated connection object.
  * buf: The buffer to output.
  * len: Number of bytes to write out.
- * returns: -1 if error, otherwise the number of bytes written out.
+ * returns: -1 if error, 0 otherwise.
  */
-int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
-  /* If already wrote EOF, can't write more. */
-  if (conn->wrote_eof)
-    return 0;
-
-  /* Writing EOF. */
-  if (len == 0) {
-    conn->wrote_eof = true;
-    return 0;
-  }
-
-  /* If already wrote out an error, can't continue writing. */
-  if (conn->wrote_err) {
-    fprintf(stderr, "[ERROR] Attempting to write after error\n");
-    return -1;
-  }
-
+static int conn_write_out(conn_t *conn, const char *buf, size_t len) {
   int left = len;
   int w = 0;
 
-  /* See if there is actually room to output. */
-  if (!conn_bufspace(conn))
-    return 0;
-
   /* Nothing in the output queue. Output immediately to the appropriate
      interface. */
   if (!conn->out_queue) {
-    if (run_program)
-      w = write(conn->stdin, buf, len);
-    else
-      w = write(STDOUT_FILENO, buf, len);
+    w = write(conn->out_fd, buf, len);
 
     if (w < 0) {
       if (errno != EAGAIN) {
@@ -959,6 +1625,7 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   /* Put the rest in an output queue. */
   if (left > 0) {
     chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
+    conn_mem_charge(conn, MEM_OUT_QUEUE, offsetof(chunk_t, buf[left]));
     chunk->next = NULL;
     chunk->size = left;
     chunk->used = 0;
@@ -970,35 +1637,267 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
   }
 
   /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
+  if (conn->out_queue)
+    conn->out_poll->events |= POLLOUT;
+  return 0;
+}
+
+/**
+ * Writes a buffer to STDOUT or the program associated with this connection.
+ * If called with a length of 0, an EOF is recorded.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
+  /* If already wrote EOF, can't write more. */
+  if (conn->wrote_eof)
+    return 0;
+
+  /* Writing EOF. */
+  if (len == 0) {
+    conn->wrote_eof = true;
+    if (conn->stripe != NULL)
+      stripe_output(conn->stripe, buf, 0);
+    if (conn->msg != NULL && msg_pending(conn->msg))
+      fprintf(stderr, "[ERROR] Last record was cut short\n");
+    if (conn->compress != NULL && compress_pending(conn->compress))
+      fprintf(stderr, "[ERROR] Last compressed block was cut short\n");
+    conn_close_output(conn);
+    return 0;
+  }
+
+  /* If already wrote out an error, can't continue writing. */
+  if (conn->wrote_err) {
+    fprintf(stderr, "[ERROR] Attempting to write after error\n");
+    return -1;
+  }
+
+  /* See if there is actually room to output. */
+  if (!conn_bufspace(conn))
+    return 0;
+
+  /* Part of a striped transfer. It is written out in order with the rest of
+     the transfer. */
+  if (conn->stripe != NULL) {
+    if (stripe_output(conn->stripe, buf, len) < 0) {
+      conn->wrote_err = true;
+      return -1;
+    }
+    events[STDOUT_FILENO].events |= POLLOUT;
+    PERF_ADD_BYTES(len);
+    return len;
+  }
+
+  /* Message mode. Each record is written out once it is complete. */
+  if (conn->msg != NULL) {
+    size_t taken = 0;
+    while (taken < len) {
+      const char *record;
+      size_t record_len;
+      int n = msg_take(conn->msg, buf + taken, len - taken, &record,
+                       &record_len);
+      if (n < 0) {
+        fprintf(stderr, "[ERROR] Record larger than %d bytes\n", MSG_MAX_SIZE);
+        conn->wrote_err = true;
+        conn->reset = true;
+        return -1;
+      }
+      taken += n;
+      if (record != NULL && conn_write_out(conn, record, record_len) < 0)
+        return -1;
+    }
+    PERF_ADD_BYTES(len);
+    return len;
+  }
+
+  /* Compressed. Each block is decompressed once all of it came in. */
+  if (conn->compress != NULL) {
+    size_t taken = 0;
+    while (taken < len) {
+      const char *block;
+      size_t block_len;
+      int n = compress_output(conn->compress, buf + taken, len - taken, &block,
+                              &block_len);
+      if (n < 0) {
+        fprintf(stderr, "[ERROR] Could not decompress the data received\n");
+        conn->wrote_err = true;
+        conn->reset = true;
+        return -1;
+      }
+      taken += n;
+      if (block != NULL && conn_write_out(conn, block, block_len) < 0)
+        return -1;
+    }
+    PERF_ADD_BYTES(len);
+    return len;
   }
+
+  if (conn_write_out(conn, buf, len) < 0)
+    return -1;
+  PERF_ADD_BYTES(len);
   return len;
 }
 
 /**
  * [Client-only]
- * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
+ * Start the TCP handshake with the server by sending a SYN. The rest of the
+ * handshake happens in the main loop: the SYN is retransmitted with backoff
+ * by tcp_handshake_timer() until tcp_handshake() gets the SYN-ACK. A SYN that
+ * could not be sent (e.g. the server is not up yet) is treated as lost.
  *
- * returns: A connection object if able to connect, NULL otherwise. This
- *          object must be freed.
+ * conn: The connection to the server.
  */
-conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
-  char buf[MAX_PACKET_SIZE];
+void tcp_connect(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  handshake_t *hs = calloc(sizeof(handshake_t), 1);
+  conn->hs = hs;
+  conn->connecting = true;
+  hs->connect_start = current_time();
+  hs->syn_sent = hs->connect_start;
+  hs->syn_rto = ctcp_cfg->rt_timeout;
+  hs->syn_retries = 0;
+  conn->handshake_rtt = current_time_us();
+
+  /* Fast open. Send the input already available with the SYN if we have a
+     cookie from the server, otherwise ask for one. */
+  if (fastopen_enabled) {
+    uint8_t cookie[FASTOPEN_COOKIE_LEN];
+    conn->fastopen = true;
+
+    if (fastopen_cache_get(conn->ip_addr, conn->port, cookie)) {
+      char buf[MAX_SEG_DATA_SIZE];
+      int r = conn_input(conn, buf, MAX_SEG_DATA_SIZE - FASTOPEN_OPT_LEN);
+      if (r > 0) {
+        hs->syn_data = malloc(r);
+        memcpy(hs->syn_data, buf, r);
+        conn->syn_data_len = r;
+      }
+      send_fastopen_seg(conn, TH_SYN, cookie, hs->syn_data,
+                        conn->syn_data_len);
+    }
+    else {
+      send_fastopen_seg(conn, TH_SYN, NULL, NULL, 0);
+    }
+  }
+  else {
+    send_syn(conn);
+  }
 
-  /* Send a SYN segment to the server. */
-  if (send_syn(config->sconn))
-    exit(EXIT_FAILURE);
+  /* Don't read any more input until the connection is established. */
+  conn_throttle_input(conn, THROTTLE_CONNECT, true);
+}
 
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
-  if (r <= 0)
-    return NULL;
+/**
+ * [Client-only]
+ * Retransmit the SYNs of connections still waiting for a SYN-ACK, doubling
+ * the timeout each time. Gives up on a connection after CONN_TIMEOUT seconds.
+ */
+void tcp_handshake_timer() { ASSERT_CLIENT_ONLY;
+  conn_t *conn;
+  long now = current_time();
+
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    handshake_t *hs = conn->hs;
+    if (!conn->connecting || now - hs->syn_sent < hs->syn_rto)
+      continue;
+
+    if (now - hs->connect_start >= CONN_TIMEOUT * 1000) {
+      fprintf(stderr, "[ERROR] Could not connect to server!\n");
+      conn->connecting = false;
+      conn_remove(conn);
+      end_client();
+      continue;
+    }
+
+    /* Resend the SYN. Its sequence number is still the initial one. Any
+       fast-open data is left out, in case that is why there was no reply;
+       it gets sent normally once connected if the server did not take it. */
+    hs->syn_sent = now;
+    hs->syn_retries++;
+    hs->syn_rto *= 2;
+    if (hs->syn_rto > SYN_MAX_RTO)
+      hs->syn_rto = SYN_MAX_RTO;
+    if (conn->fastopen)
+      send_fastopen_seg(conn, TH_SYN, NULL, NULL, 0);
+    else
+      send_syn(conn);
+  }
+}
+
+/**
+ * [Client-only]
+ * Handles the fast-open part of a SYN-ACK. Stores the cookie the server sent,
+ * and finds out whether the server took the data sent with the SYN. If it did,
+ * sequence numbers move past the data. If not, the data is sent again once
+ * connected.
+ *
+ * conn: The connection to the server.
+ * pkt: The SYN-ACK received.
+ */
+void tcp_fastopen_synack(conn_t *conn, char *pkt) { ASSERT_CLIENT_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *synack = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  char *payload = (char *)((uint8_t *) synack + TCP_HDR_SIZE);
+  fastopen_opt_t opt;
+
+  if (fastopen_parse(payload, ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE, &opt) ==
+      FASTOPEN_OPT_LEN)
+    fastopen_cache_put(conn->ip_addr, conn->port, opt.cookie);
+
+  if (conn->hs->syn_data != NULL &&
+      ntohl(synack->th_ack) == conn->init_seqno + 1 + conn->syn_data_len) {
+    conn->init_seqno += conn->syn_data_len;
+    conn->next_seqno += conn->syn_data_len;
+    free(conn->hs->syn_data);
+    conn->hs->syn_data = NULL;
+
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Server took %d bytes sent with the SYN\n",
+              conn->syn_data_len);
+  }
+}
+
+/**
+ * [Client-only]
+ * Handles the compression part of a SYN-ACK. The data is compressed both ways
+ * if the server agreed to it.
+ *
+ * conn: The connection to the server.
+ * pkt: The SYN-ACK received.
+ */
+void tcp_compress_synack(conn_t *conn, char *pkt) { ASSERT_CLIENT_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  char *payload = pkt + FULL_HDR_SIZE;
+
+  if (compress_parse(payload, ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE)) {
+    conn->compressed = true;
+    conn->compress = compress_new();
+  }
+  else {
+    fprintf(stderr, "[INFO] Server does not compress\n");
+  }
+}
 
-  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+/**
+ * [Client-only]
+ * Finish the TCP handshake with server after receiving the SYN-ACK: send the
+ * ACK and go to student code.
+ *
+ * conn: The connection to the server.
+ * pkt: The SYN-ACK (or ACK, if continuing a previous connection) received.
+ * returns: The connection object if connected, NULL otherwise.
+ */
+conn_t *tcp_handshake(conn_t *conn, char *pkt) { ASSERT_CLIENT_ONLY;
+  tcphdr_t *synack = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  conn->connecting = false;
+
+  /* Only use the handshake RTT if the SYN was not retransmitted. */
+  if (conn->hs->syn_retries == 0)
+    conn->handshake_rtt = current_time_us() - conn->handshake_rtt;
+  else
+    conn->handshake_rtt = 0;
 
   /* Set window size for the other host. */
   ctcp_cfg->send_window = ntohs(synack->window);
@@ -1006,70 +1905,330 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
   if ((synack->th_flags & TH_SYN) == 0) {
-    config->sconn->init_seqno = ntohl(synack->th_ack) - 1;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq) - 1;
+    conn->init_seqno = ntohl(synack->th_ack) - 1;
+    conn->their_init_seqno = ntohl(synack->th_seq) - 1;
 
-    config->sconn->next_seqno = config->sconn->init_seqno + 1;
-    config->sconn->ackno = ntohl(synack->th_seq);
+    conn->next_seqno = conn->init_seqno + 1;
+    conn->ackno = ntohl(synack->th_seq);
   }
 
   /* Otherwise, set new acknowledgement number and send ACK response */
   else {
-    config->sconn->next_seqno++;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq);
-    config->sconn->ackno = ntohl(synack->th_seq) + 1;
-    send_ack(config->sconn);
+    conn->next_seqno++;
+    conn->their_init_seqno = ntohl(synack->th_seq);
+    conn->ackno = ntohl(synack->th_seq) + 1;
+    if (conn->fastopen)
+      tcp_fastopen_synack(conn, pkt);
+    if (compress_enabled)
+      tcp_compress_synack(conn, pkt);
+    send_ack(conn);
   }
 
-  return config->sconn;
+  /* Go to student code. */
+  ctcp_state_t *state = ctcp_init(conn, conn_config(conn));
+  if (state == NULL) {
+    fprintf(stderr, "[ERROR] Could not connect to server!\n");
+    conn_remove(conn);
+    end_client();
+    return NULL;
+  }
+  fprintf(stderr, "[INFO] Connected to server\n");
+  conn->state = state;
+
+  /* Start reading input, beginning with fast-open data the server did not
+     take. */
+  conn_throttle_input(conn, THROTTLE_CONNECT, false);
+  if (conn->hs->syn_data != NULL)
+    ctcp_read(state);
+  else
+    conn_handshake_done(conn);
+  return conn;
 }
 
 /**
- * [Server only]
- * Handle a new connection from a client. Set up connection details and
- * initialize sequence numbers.
+ * [Client-only]
+ * Frees the connection setup state once the handshake is over and the data
+ * sent with the SYN has been handed on.
  *
- * pkt: The SYN segment from the client.
- * returns: The conn_t associated with the new connection.
+ * conn: The connection to the server.
  */
-conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
-  /* Ignore if too many clients are connected. */
-  if (num_connected >= MAX_NUM_CLIENTS) {
-    fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
-            MAX_NUM_CLIENTS);
-    return NULL;
+void conn_handshake_done(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  if (conn->hs == NULL || conn->connecting || conn->hs->syn_data != NULL)
+    return;
+  free(conn->hs);
+  conn->hs = NULL;
+}
+
+/**
+ * Finds the connection to a given host and port.
+ *
+ * ip_addr: IP address of the host.
+ * port: Port of the host.
+ * returns: The connection object, or NULL if there is none.
+ */
+conn_t *conn_find(in_addr_t ip_addr, int port) {
+  conn_t *conn;
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    if (conn->port == port && (unix_socket || conn->ip_addr == ip_addr))
+      return conn;
   }
-  num_connected++;
+  return NULL;
+}
 
+/**
+ * [Server only]
+ * Handles the fast-open block of a SYN, if there is one.
+ *
+ * pkt: The SYN segment from the client.
+ * data_len: Return parameter. Length of the data sent with the SYN if the
+ *           cookie is valid, 0 otherwise (the client sends it again later).
+ * returns: Whether or not the SYN has a fast-open block, i.e. whether or not
+ *          the SYN-ACK should carry a cookie.
+ */
+bool tcp_fastopen_syn(char *pkt, uint16_t *data_len) { ASSERT_SERVER_ONLY;
   iphdr_t *ip_hdr = (iphdr_t *) pkt;
   tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  char *payload = (char *)((uint8_t *) syn + TCP_HDR_SIZE);
+  uint16_t len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
+  fastopen_opt_t opt;
+
+  *data_len = 0;
+  uint16_t opt_len = fastopen_parse(payload, len, &opt);
+  if (opt_len == 0)
+    return false;
+
+  if (opt_len == FASTOPEN_OPT_LEN &&
+      fastopen_check(ntohl(ip_hdr->saddr), opt.cookie))
+    *data_len = len - opt_len;
+  return true;
+}
+
+/**
+ * [Server only]
+ * Sets up a connection whose handshake is complete: adds it to the list of
+ * connections, goes to student code and starts the program, if any.
+ *
+ * ip_addr: IP address of the client.
+ * port: Port of the client.
+ * their_init_seqno: The client's initial sequence number.
+ * init_seqno: Our initial sequence number.
+ * window: The client's receive window.
+ * compressed: Whether or not compression was agreed on.
+ * returns: The conn_t associated with the new connection.
+ */
+conn_t *tcp_accept(in_addr_t ip_addr, int port, uint32_t their_init_seqno,
+                   uint32_t init_seqno, uint16_t window,
+                   bool compressed) { ASSERT_SERVER_ONLY;
+  num_connected++;
 
   /* Set up connection details and add to list of connections. */
   conn_t *conn = calloc(sizeof(conn_t), 1);
-  conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
-  conn->their_init_seqno = ntohl(syn->th_seq);
-  conn->ackno = conn->their_init_seqno + 1;
+  conn_setup(conn, ip_addr, port, unix_socket);
+  conn->init_seqno = init_seqno;
+  conn->next_seqno = init_seqno;
+  conn->their_init_seqno = their_init_seqno;
+  conn->ackno = their_init_seqno + 1;
   conn_add(conn);
-
-  /* Send a SYN-ACK to the client. */
-  send_synack(conn);
+  if (compressed) {
+    conn->compressed = true;
+    conn->compress = compress_new();
+  }
 
   /* Get window size of the client. */
-  ctcp_cfg->send_window = ntohs(syn->window);
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  ctcp_cfg->send_window = window;
 
   /* Student code. */
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  ctcp_state_t *state = ctcp_init(conn, conn_config(conn));
   conn->state = state;
 
+  /* Start a new program associated with this client, or send its output to
+     a sink of its own. */
+  if (run_program)
+    execute_program(conn);
+  else if (sink_pattern != NULL)
+    open_sink(conn);
+
   fprintf(stderr, "[INFO] Client connected\n");
   return conn;
 }
 
+/**
+ * [Server only]
+ * Handle a new connection from a client. Nothing is kept for it: the SYN-ACK
+ * carries a SYN cookie as our initial sequence number, and the connection is
+ * only set up once the client's ACK returns the cookie (see tcp_cookie_ack).
+ *
+ * The exception is a SYN carrying data and a valid fast-open cookie. That
+ * connection is set up right away so the data can be handed on.
+ *
+ * pkt: The SYN segment from the client.
+ * returns: The conn_t associated with the new connection if it was set up
+ *          right away, NULL otherwise.
+ */
+conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  char *payload = (char *)((uint8_t *) syn + TCP_HDR_SIZE);
+  uint32_t their_init_seqno = ntohl(syn->th_seq);
+  uint16_t data_len = 0;
+  bool fastopen = fastopen_enabled && tcp_fastopen_syn(pkt, &data_len);
+  bool compressed = compress_enabled &&
+    compress_parse(payload, ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE);
+
+  /* Fast open. Move the sequence numbers past the data and hand it on. */
+  if (data_len > 0 && num_connected < MAX_NUM_CLIENTS) {
+    conn_t *conn = tcp_accept(ntohl(ip_hdr->saddr), ntohs(syn->th_sport),
+                              their_init_seqno + data_len, rand(),
+                              ntohs(syn->window), false);
+    conn->fastopen = true;
+    conn->syn_data_len = data_len;
+    send_synack(conn);
+    conn_output(conn, payload + FASTOPEN_OPT_LEN, data_len);
+    return conn;
+  }
+
+  /* Answer with a SYN cookie, from a connection object that is not kept. */
+  conn_t conn;
+  memset((void *) &conn, 0, sizeof(conn_t));
+  conn_setup(&conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
+  conn.init_seqno = syncookie_make(ip_hdr->saddr, conn.port, their_init_seqno,
+                                   compressed ? SYNCOOKIE_OPT_COMPRESS : 0);
+  conn.next_seqno = conn.init_seqno;
+  conn.ackno = their_init_seqno + 1;
+  conn.fastopen = fastopen;
+  conn.compressed = compressed;
+  send_synack(&conn);
+  return NULL;
+}
+
+/**
+ * [Server only]
+ * Handles a segment from a host we have no connection with, in case it
+ * completes a handshake answered with a SYN cookie. The first segment the
+ * client sends after the SYN-ACK (its ACK, or its first data segment if the
+ * ACK was lost) acknowledges the cookie plus one.
+ *
+ * If all connection slots are taken, the completed handshake waits in the
+ * accept backlog, and later segments from the client are dropped until a slot
+ * frees up. If the backlog is full too, the segment is dropped; the client
+ * sends its first data segment again.
+ *
+ * pkt: The IP packet received.
+ * rconn: Return parameter. The new connection, if the segment carries more
+ *        than the ACK and should be passed on.
+ * returns: Whether or not the segment belongs to a handshake answered with a
+ *          SYN cookie.
+ */
+bool tcp_cookie_ack(char *pkt, conn_t **rconn) { ASSERT_SERVER_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  int port = ntohs(tcp_hdr->th_sport);
+  uint32_t their_init_seqno = ntohl(tcp_hdr->th_seq) - 1;
+  uint32_t init_seqno = ntohl(tcp_hdr->th_ack) - 1;
+
+  /* Already waiting for a free slot. */
+  int i;
+  for (i = 0; i < backlog_len; i++) {
+    if (backlog[i].port == port &&
+        (unix_socket || backlog[i].ip_addr == ip_hdr->saddr))
+      return true;
+  }
+
+  int opts;
+  if (!syncookie_check(ip_hdr->saddr, port, their_init_seqno, init_seqno,
+                       &opts))
+    return false;
+  bool compressed = opts & SYNCOOKIE_OPT_COMPRESS;
+
+  /* Set up the connection. Pass on anything more than the ACK. */
+  if (num_connected < MAX_NUM_CLIENTS && backlog_len == 0) {
+    conn_t *conn = tcp_accept(ntohl(ip_hdr->saddr), port, their_init_seqno,
+                              init_seqno, ntohs(tcp_hdr->window), compressed);
+    if (rconn != NULL && (ntohs(ip_hdr->tot_len) > FULL_HDR_SIZE ||
+                          (tcp_hdr->th_flags & TH_FIN)))
+      *rconn = conn;
+    return true;
+  }
+
+  /* Wait for a free slot. */
+  if (backlog_len == ACCEPT_BACKLOG) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Accept backlog full, dropping handshake\n");
+    return true;
+  }
+  pending_conn_t *pending = &backlog[backlog_len++];
+  pending->ip_addr = ip_hdr->saddr;
+  pending->port = port;
+  pending->their_init_seqno = their_init_seqno;
+  pending->init_seqno = init_seqno;
+  pending->window = ntohs(tcp_hdr->window);
+  pending->compressed = compressed;
+  pending->queued = current_time();
+  return true;
+}
+
+/**
+ * [Server only]
+ * Sets up the connections waiting in the accept backlog, oldest first, while
+ * there are free slots. Drops the ones that waited longer than CONN_TIMEOUT;
+ * those clients have given up.
+ */
+void tcp_accept_backlog() { ASSERT_SERVER_ONLY;
+  long now = current_time();
+  while (backlog_len > 0 && num_connected < MAX_NUM_CLIENTS) {
+    pending_conn_t pending = backlog[0];
+    backlog_len--;
+    memmove(backlog, backlog + 1, backlog_len * sizeof(pending_conn_t));
+
+    if (now - pending.queued < CONN_TIMEOUT * 1000)
+      tcp_accept(ntohl(pending.ip_addr), pending.port,
+                 pending.their_init_seqno, pending.init_seqno,
+                 pending.window, pending.compressed);
+  }
+}
+
 
 ///////////////////////////// SETUP AND MAIN LOOP /////////////////////////////
 
+/**
+ * [Server only]
+ * Checks whether a poll slot for program output still belongs to a
+ * connection. A slot stops being polled once the program hangs up, but is
+ * only free again when the connection goes away.
+ *
+ * slot: The poll slot.
+ * returns: Whether or not a connection uses the slot.
+ */
+static bool poll_slot_taken(struct pollfd *slot) {
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->poll_fd == slot || conn->out_poll == slot)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * [Server only]
+ * Starts polling a connection's fd, in the first free slot.
+ *
+ * fd: The fd. It is made non-blocking.
+ * events_wanted: What to poll for.
+ * returns: The slot.
+ */
+static struct pollfd *poll_slot_add(int fd, short events_wanted) {
+  int id = NUM_POLL;
+  while (events[id].fd >= 0 || poll_slot_taken(&events[id]))
+    id++;
+
+  struct pollfd *slot = &events[id];
+  slot->fd = fd;
+  slot->events = events_wanted;
+  slot->revents = 0;
+  async(fd);
+  return slot;
+}
+
 /**
  * [Server only]
  * Executes a new program upon client connection. When the client sends a
@@ -1110,16 +2269,63 @@ void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
     conn->stdin = PARENT_WRITE_FD;
     conn->stdout = PARENT_READ_FD;
 
-    /* Start polling the stdout. */
-    int id = NUM_POLL + num_connected - 1;
-    struct pollfd *stdout = &events[id];
-    stdout->fd = conn->stdout;
-    async(stdout->fd);
-    stdout->events = POLLIN | POLLHUP;
-    conn->poll_fd = stdout;
+    /* Start polling the stdout, and the stdin once output is waiting for
+       room in it. */
+    conn->poll_fd = poll_slot_add(conn->stdout, POLLIN | POLLHUP);
+    conn->out_fd = conn->stdin;
+    conn->out_poll = poll_slot_add(conn->stdin, 0);
+    if (conn->mux != NULL)
+      mux_add_input(conn->mux, 0, conn->stdout, conn->poll_fd);
   }
 }
 
+/**
+ * [Server only]
+ * Opens the output sink of a new connection (--sink): a file, or a Unix
+ * socket to connect to, named after the connection. Output goes to STDOUT if
+ * it cannot be opened.
+ *
+ * conn: The conn_t associated with the client.
+ */
+void open_sink(conn_t *conn) { ASSERT_SERVER_ONLY;
+  bool to_socket = strncmp(sink_pattern, "unix:", 5) == 0;
+  const char *pattern = strchr(sink_pattern, ':') + 1;
+  const char *id = strstr(pattern, "%u");
+  char path[256];
+  int fd;
+
+  if (id == NULL)
+    snprintf(path, sizeof(path), "%s", pattern);
+  else
+    snprintf(path, sizeof(path), "%.*s%u%s", (int) (id - pattern), pattern,
+             conn->id, id + 2);
+
+  if (to_socket) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  else {
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  }
+
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Could not open output sink %s, using STDOUT\n",
+            path);
+    return;
+  }
+  conn->out_fd = fd;
+  conn->out_poll = poll_slot_add(fd, 0);
+  fprintf(stderr, "[INFO] Output of connection %u goes to %s\n", conn->id,
+          path);
+}
+
 /**
  * Delete all connections.
  */
@@ -1133,6 +2339,70 @@ void delete_all_connections() {
   }
 }
 
+/**
+ * Gives every connection its share of the work for the next pass through the
+ * event loop (deficit round robin). A connection that went over its share
+ * last time, by reading or writing a whole chunk at once, gets that much
+ * less; one that did not use its share does not keep it.
+ */
+static void drr_refill() {
+  conn_t *conn;
+  for (conn = get_connections(); conn != NULL; conn = conn->next) {
+    if (conn->deficit < 0)
+      conn->deficit += DRR_QUANTUM;
+    else
+      conn->deficit = DRR_QUANTUM;
+  }
+}
+
+/**
+ * [Server-only]
+ * Reads STDIN once for every connection (--broadcast). Each chunk is read
+ * into a shared buffer and handed to all connections, which keep it without
+ * copying.
+ */
+static void broadcast_read() {
+  conn_t *conn;
+  int i;
+
+  /* Leave the input where it is until someone is listening. */
+  if (get_connections() == NULL)
+    return;
+
+  for (i = 0; i < DRR_QUANTUM / MAX_SEG_DATA_SIZE; i++) {
+    shared_buf_t *buf = malloc(offsetof(shared_buf_t, data[MAX_SEG_DATA_SIZE]));
+    int r = read_stdin(buf->data, MAX_SEG_DATA_SIZE);
+    if (r < 0 && errno == EAGAIN) {
+      free(buf);
+      return;
+    }
+
+    /* EOF. Every connection sends a FIN after what it already has. */
+    if (r <= 0) {
+      free(buf);
+      events[STDIN_FILENO].fd = -1;
+      for (conn = get_connections(); conn != NULL; conn = conn->next) {
+        conn->read_eof = true;
+        if (conn->state != NULL && !conn->delete_me)
+          ctcp_read(conn->state);
+      }
+      return;
+    }
+
+    PERF_ADD_BYTES(r);
+    buf->refs = 1;
+    buf->len = r;
+    for (conn = get_connections(); conn != NULL; conn = conn->next) {
+      if (conn->state == NULL || conn->delete_me)
+        continue;
+      conn->broadcast = buf;
+      ctcp_read(conn->state);
+      conn->broadcast = NULL;
+    }
+    shared_buf_release(buf);
+  }
+}
+
 /**
  * Main loop. Handles the following:
  *   - Input from STDIN.
@@ -1143,37 +2413,109 @@ void delete_all_connections() {
 void do_loop() {
   char buf[MAX_PACKET_SIZE];
   conn_t *conn = NULL;
+  int prio, i;
 
   while (true) {
     memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
+    poll(events, NUM_POLL + NUM_CONN_POLL,
          need_timer_in(&last_timeout, ctcp_cfg->timer));
 
+    /* Interrupted or terminated, see exit_on_signal(). A trace dump asked
+       for with SIGUSR1 is written here too. */
+    if (exit_signal)
+      exit(128 + exit_signal);
+    trace_poll();
+
+    /* No connection gets more than its share of reading and draining, so
+       one with a large backlog cannot hold up the others. */
+    drr_refill();
+
+    /* Room in the socket for segments that are waiting. */
+    if (events[2].revents & POLLOUT)
+      send_queue_flush();
+
     /* Input from stdin. Server will only send to most-recently connected
-       client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
+       client, or to every client if broadcasting. */
+    if (broadcast && events[STDIN_FILENO].revents & (POLLIN | POLLHUP)) {
+      broadcast_read();
+    }
+    else if (!run_program && events[STDIN_FILENO].revents & (POLLIN | POLLHUP)) {
       conn = get_connections();
 
-      if (conn != NULL)
+      if (conn != NULL && conn->state != NULL)
+        ctcp_read(conn->state);
+    }
+
+    /* Input from the other streams of the client. */
+    for (i = 0; i < num_stream_files; i++) {
+      conn = get_connections();
+      if (stream_polls[i]->revents & (POLLIN | POLLHUP) && conn != NULL &&
+          conn->state != NULL) {
         ctcp_read(conn->state);
+        break;
+      }
+    }
+
+    /* Records or compressed blocks read but not sent yet, e.g. because the
+       connection used up its share. They are not polled for, the input may
+       have gone quiet. */
+    if (msg_enabled || compress_enabled) {
+      for (conn = get_connections(); conn; conn = conn->next) {
+        if (conn->state != NULL && !conn->delete_me &&
+            ((conn->msg != NULL && msg_held(conn->msg)) ||
+             (conn->compress != NULL && compress_held(conn->compress))))
+          ctcp_read(conn->state);
+      }
     }
 
-    /* See if we can output more. */
-    if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
+    /* See if we can output more. Only the connections whose output has
+       room are drained, so one that is stuck does not hold up the others.
+       Every connection with output left over asks to be polled again. */
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (conn->out_poll->revents & (POLLOUT | POLLHUP | POLLERR))
+        conn->out_poll->events &= ~POLLOUT;
+    }
+    for (prio = PRIO_INTERACTIVE; prio < PRIO_NUM_CLASSES; prio++) {
       for (conn = get_connections(); conn; conn = conn->next) {
-        conn_drain(conn);
+        if (conn->prio == prio &&
+            conn->out_poll->revents & (POLLOUT | POLLHUP | POLLERR))
+          PROF_CALL(PROF_CONN_DRAIN, conn->id, conn_drain(conn));
+      }
+    }
+
+    /* Write out striped transfers in order. Connections that were refused
+       output because they were too far ahead go on once it caught up. */
+    if (stripe_server) {
+      if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR))
+        events[STDOUT_FILENO].events &= ~POLLOUT;
+      if (stripe_drain())
+        events[STDOUT_FILENO].events |= POLLOUT;
+      for (conn = get_connections(); conn; conn = conn->next) {
+        if (conn->stripe == NULL || conn->state == NULL || conn->delete_me)
+          continue;
+
+        /* Not part of a striped transfer. Turn it away. */
+        if (conn->wrote_err) {
+          send_rst(conn);
+          ctcp_destroy(conn->state);
+        }
+        else if (stripe_unblocked(conn->stripe)) {
+          ctcp_output(conn->state);
+        }
       }
     }
 
     /* Poll for output received from running programs. Send to client
-       client associated with this program instance. */
+       client associated with this program instance. Higher classes go
+       first. */
     if (run_program) {
-      conn = get_connections();
-      while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
-          ctcp_read(conn->state);
+      for (prio = PRIO_INTERACTIVE; prio < PRIO_NUM_CLASSES; prio++) {
+        for (conn = get_connections(); conn; conn = conn->next) {
+          if (conn->prio == prio && !conn->delete_me &&
+              conn->poll_fd->revents & (POLLIN | POLLHUP)) {
+            ctcp_read(conn->state);
+          }
         }
-        conn = conn->next;
       }
     }
 
@@ -1183,10 +2525,25 @@ void do_loop() {
       conn = NULL;
       int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
       if (len >= FULL_HDR_SIZE) {
+        iphdr_t *ip_hdr = (iphdr_t *) buf;
         tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
 
+        /* Reply to our SYN. Finish the handshake. Anything else that
+           arrives before it, e.g. a segment of a previous connection from
+           this port, is dropped. */
+        if (!SERVER && (conn != NULL || (tcp_hdr->th_flags & TH_SYN))) {
+          if (conn == NULL)
+            conn = conn_find(ip_hdr->saddr, ntohs(tcp_hdr->th_sport));
+          if (conn != NULL && conn->connecting) {
+            if (ntohl(tcp_hdr->th_ack) - conn->init_seqno - 1 <=
+                conn->syn_data_len)
+              tcp_handshake(conn, buf);
+            conn = NULL;
+          }
+        }
+
         /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
+        if (conn != NULL && conn->state != NULL) {
           ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
           len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
 
@@ -1203,30 +2560,60 @@ void do_loop() {
               log_segment(log_file, config->ip_addr, config->port, conn,
                           segment, len, false, unix_socket);
             }
-            ctcp_receive(conn->state, segment, len);
+            PROF_CALL(PROF_CTCP_RECEIVE, conn->id,
+                      ctcp_receive(conn->state, segment, len));
           }
         }
 
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
+        /* Retransmitted SYN of a connection we already accepted. Resend the
+           SYN-ACK. */
+        else if (SERVER && (tcp_hdr->th_flags & TH_SYN) &&
+                 (conn = conn_find(ip_hdr->saddr, ntohs(tcp_hdr->th_sport))) &&
+                 conn->their_init_seqno - conn->syn_data_len ==
+                   ntohl(tcp_hdr->th_seq)) {
+          send_synack(conn);
+        }
 
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
+        /* New connection. If the port still has a connection open, the host
+           was restarted and that connection is gone, so drop it. */
+        else if (SERVER && (tcp_hdr->th_flags & TH_SYN)) {
+          conn = conn_find(ip_hdr->saddr, ntohs(tcp_hdr->th_sport));
+          if (conn != NULL && conn->state != NULL && !conn->delete_me)
+            ctcp_destroy(conn->state);
+
+          /* Only set up right away for fast open. Then don't pass the ACK
+             of the SYN-ACK on to student code. */
+          if (tcp_new_connection(buf) != NULL)
+            new_connection = tcp_hdr->th_sport;
         }
       }
     }
 
     /* Check if timer is up. */
     if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+      if (!SERVER)
+        tcp_handshake_timer();
       ctcp_timer();
       get_time(&last_timeout);
     }
 
-    /* Delete connections if needed. */
+    /* Output that could not be parsed into records or blocks. Nothing more
+       can be written out, so reset the connection rather than leave the
+       other host sending into it. */
+    for (conn = get_connections(); conn; conn = conn->next) {
+      if (conn->reset && conn->state != NULL && !conn->delete_me) {
+        send_rst(conn);
+        if (!SERVER)
+          exit(EXIT_FAILURE);
+        ctcp_destroy(conn->state);
+      }
+    }
+
+    /* Delete connections if needed, and let clients waiting for a free
+       slot in. */
     delete_all_connections();
+    if (SERVER)
+      tcp_accept_backlog();
   }
 }
 
@@ -1252,6 +2639,11 @@ void setup_poll() {
   socket->events = POLLIN | POLLHUP | POLLERR;
   async(config->socket);
 
+  /* No programs running yet. */
+  int i;
+  for (i = NUM_POLL; i < NUM_POLL + NUM_CONN_POLL; i++)
+    events[i].fd = -1;
+
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
 }
@@ -1267,6 +2659,9 @@ void end_client() {
   }
 
   delete_all_connections();
+  /* Last try for segments still waiting, such as the ACK of the server's
+     FIN. */
+  send_queue_flush();
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
   exit(EXIT_SUCCESS);
@@ -1282,19 +2677,22 @@ int start_client(char *server, char *port) {
   if (do_config_server(server) < 0 || do_config(port) < 0)
     return -1;
 
-  /* Initialize connection with server. Go to student code. */
-  conn_t *conn = tcp_handshake();
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
-  if (state == NULL) {
-    fprintf(stderr, "[ERROR] Could not connect to server!\n");
-    return -1;
-  }
-  fprintf(stderr, "[INFO] Connected to server\n");
-  config->sconn->state = state;
-
+  /* Initialize connection with server. The handshake finishes in the main
+     loop, which goes to student code once connected. */
   setup_poll();
+
+  /* The other streams, read along with STDIN. */
+  int i;
+  for (i = 0; i < num_stream_files; i++) {
+    int fd = open(stream_files[i], O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "[ERROR] Could not open stream %s\n", stream_files[i]);
+      return -1;
+    }
+    stream_polls[i] = poll_slot_add(fd, POLLIN | POLLHUP);
+    mux_add_input(config->sconn->mux, i + 1, fd, stream_polls[i]);
+  }
+  tcp_connect(config->sconn);
   do_loop();
   return 0;
 }
@@ -1307,7 +2705,7 @@ int start_client(char *server, char *port) {
  * argv: Array containing arguments to program.
  */
 int start_server(char *port, int argc, char *argv[]) {
-  if (do_config(port) < 0)
+  if (do_config(port) < 0 || syncookie_init() < 0)
     return -1;
 
   /* Keep track of program to start and its arguments. */
@@ -1324,6 +2722,34 @@ int start_server(char *port, int argc, char *argv[]) {
   return 0;
 }
 
+/**
+ * Asks the event loop to exit normally when interrupted or terminated, so that
+ * exit handlers (trace dump, profiling summary, hardware counters) still get
+ * to run. exit() is not safe to call from the handler itself.
+ *
+ * sig: The signal received.
+ */
+static void exit_on_signal(int sig) {
+  exit_signal = sig;
+}
+
+/**
+ * Checks that a file name pattern has the given number of %u, and nothing
+ * else that printf() would take.
+ *
+ * pattern: The pattern.
+ * count: Number of %u it should have.
+ */
+static bool pattern_valid(const char *pattern, int count) {
+  const char *p;
+  for (p = strchr(pattern, '%'); p != NULL; p = strchr(p + 2, '%')) {
+    if (p[1] != 'u')
+      return false;
+    count--;
+  }
+  return count == 0;
+}
+
 /**
  * Prints out a usage message.
  *
@@ -1342,6 +2768,36 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--trace trace_file]\n"
+    "   [--stats stats_file]\n"
+    "   [--stats-interval interval_ms]\n"
+    "   [--perf]\n"
+    "   [--mem-soft bytes]\n"
+    "   [--mem-hard bytes]\n"
+    "   [--fastopen[=cookie_file]]\n"
+    "   [--keepalive idle_ms]\n"
+    "   [--keepalive-interval interval_ms]\n"
+    "   [--keepalive-probes probes]\n"
+    "   [--idle-timeout idle_ms]\n"
+    "   [--metrics]\n"
+    "   [--initial-window segments]\n"
+    "   [--send-rate bytes_per_sec[:burst]]\n"
+    "   [--recv-rate bytes_per_sec[:burst]]\n"
+    "   [--total-send-rate bytes_per_sec[:burst]]\n"
+    "   [--total-recv-rate bytes_per_sec[:burst]]\n"
+    "   [--rate-file limits_file]\n"
+    "   [--class interactive|normal|bulk]\n"
+    "   [--bulk-after bytes]\n"
+    "   [--codel[=target_ms]]\n"
+    "   [--codel-interval interval_ms]\n"
+    "   [--broadcast]               [server only]\n"
+    "   [--sink file:path|unix:path] [server only]\n"
+    "   [--stripe connections]      [client only]\n"
+    "   [--unstripe]                [server only]\n"
+    "   [--streams path_%%u_%%u]\n"
+    "   [--stream path]             [client only]\n"
+    "   [--messages]\n"
+    "   [--compress]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
@@ -1361,6 +2817,24 @@ int main(int argc , char *argv[]) {
   bool is_client = 0;
   char *server = NULL;
   char *port_str = NULL;
+  char *trace_file = NULL;
+  char *stats_file = NULL;
+  int stats_interval = STATS_DEFAULT_INTERVAL;
+  bool use_perf = false;
+  char *fastopen_file = NULL;
+  bool use_fastopen = false;
+  int keepalive = 0;
+  int keepalive_interval = KEEPALIVE_INTERVAL;
+  int keepalive_probes = KEEPALIVE_PROBES;
+  int idle_timeout = 0;
+  bool use_metrics = false;
+  int initial_window = INITIAL_WINDOW;
+  char *rate_file = NULL;
+  int codel_target = -1;
+  int codel_interval = CODEL_INTERVAL;
+  int stripe_count = 0;
+  char *streams_pattern = NULL;
+  rate_limit_t rate_limit;
   int port = -1;
   int window = 1;
   seed = time(NULL);
@@ -1381,6 +2855,36 @@ int main(int argc , char *argv[]) {
     { "duplicate", required_argument, NULL, 'q' },
     { "logging", no_argument, NULL, 'l' },
     { "lab5", no_argument, NULL, 'f' },
+    { "trace", required_argument, NULL, 'T' },
+    { "stats", required_argument, NULL, 'S' },
+    { "stats-interval", required_argument, NULL, 'I' },
+    { "perf", no_argument, NULL, 'P' },
+    { "mem-soft", required_argument, NULL, 'M' },
+    { "mem-hard", required_argument, NULL, 'H' },
+    { "fastopen", optional_argument, NULL, 'F' },
+    { "keepalive", required_argument, NULL, 'K' },
+    { "keepalive-interval", required_argument, NULL, 'V' },
+    { "keepalive-probes", required_argument, NULL, 'N' },
+    { "idle-timeout", required_argument, NULL, 'O' },
+    { "metrics", no_argument, NULL, 'R' },
+    { "initial-window", required_argument, NULL, 'W' },
+    { "send-rate", required_argument, NULL, 'X' },
+    { "recv-rate", required_argument, NULL, 'Y' },
+    { "total-send-rate", required_argument, NULL, 'G' },
+    { "total-recv-rate", required_argument, NULL, 'J' },
+    { "rate-file", required_argument, NULL, 'L' },
+    { "class", required_argument, NULL, 'Q' },
+    { "bulk-after", required_argument, NULL, 'U' },
+    { "codel", optional_argument, NULL, 'A' },
+    { "codel-interval", required_argument, NULL, 'B' },
+    { "broadcast", no_argument, NULL, 'C' },
+    { "sink", required_argument, NULL, 'D' },
+    { "stripe", required_argument, NULL, 'E' },
+    { "unstripe", no_argument, NULL, 'Z' },
+    { "streams", required_argument, NULL, 'm' },
+    { "stream", required_argument, NULL, 'n' },
+    { "messages", no_argument, NULL, 'g' },
+    { "compress", no_argument, NULL, 'k' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1442,6 +2946,122 @@ int main(int argc , char *argv[]) {
     case 'f':
       lab5_mode = true;
       break;
+    /* Binary event tracing. */
+    case 'T':
+      trace_file = optarg;
+      break;
+    /* Time-series export of connection state. */
+    case 'S':
+      stats_file = optarg;
+      break;
+    case 'I':
+      stats_interval = atoi(optarg);
+      break;
+    /* Hardware performance counters. */
+    case 'P':
+      use_perf = true;
+      break;
+    /* Per-connection memory limits. */
+    case 'M':
+      mem_soft_limit = atol(optarg);
+      break;
+    case 'H':
+      mem_hard_limit = atol(optarg);
+      break;
+    /* Send data with the SYN. */
+    case 'F':
+      use_fastopen = true;
+      fastopen_file = optarg ? optarg : FASTOPEN_DEFAULT_CACHE;
+      break;
+    /* Probing and closing of idle connections. */
+    case 'K':
+      keepalive = atoi(optarg);
+      break;
+    case 'V':
+      keepalive_interval = atoi(optarg);
+      break;
+    case 'N':
+      keepalive_probes = atoi(optarg);
+      break;
+    case 'O':
+      idle_timeout = atoi(optarg);
+      break;
+    /* Per-destination metrics cache. */
+    case 'R':
+      use_metrics = true;
+      break;
+    /* Congestion window of new connections. */
+    case 'W':
+      initial_window = atoi(optarg);
+      break;
+    /* Sending and receiving rate limits. */
+    case 'X':
+    case 'Y':
+    case 'G':
+    case 'J':
+      if (ratelimit_parse(optarg, &rate_limit) < 0)
+        usage(progname);
+      ratelimit_set(opt == 'X' || opt == 'G' ? RATE_SEND : RATE_RECV,
+                    opt == 'G' || opt == 'J', &rate_limit);
+      break;
+    case 'L':
+      rate_file = optarg;
+      break;
+    /* Priority class of connections. */
+    case 'Q':
+      if (strcmp(optarg, "interactive") == 0)
+        default_prio = PRIO_INTERACTIVE;
+      else if (strcmp(optarg, "normal") == 0)
+        default_prio = PRIO_NORMAL;
+      else if (strcmp(optarg, "bulk") == 0)
+        default_prio = PRIO_BULK;
+      else
+        usage(progname);
+      break;
+    case 'U':
+      bulk_after = atol(optarg);
+      break;
+    /* Delay of input waiting to be sent. */
+    case 'A':
+      codel_target = optarg != NULL ? atoi(optarg) : CODEL_TARGET;
+      break;
+    case 'B':
+      codel_interval = atoi(optarg);
+      break;
+    /* Sending STDIN to every client. */
+    case 'C':
+      broadcast = true;
+      break;
+    /* Output of each client. */
+    case 'D':
+      sink_pattern = optarg;
+      break;
+    /* Striped transfers over several connections. */
+    case 'E':
+      stripe_count = atoi(optarg);
+      if (stripe_count < 1 || stripe_count > STRIPE_MAX_CONNS)
+        usage(progname);
+      break;
+    case 'Z':
+      stripe_server = true;
+      break;
+    /* Streams multiplexed in a connection. */
+    case 'm':
+      streams_pattern = optarg;
+      break;
+    case 'n':
+      if (num_stream_files == MUX_MAX_STREAMS - 1)
+        usage(progname);
+      stream_files[num_stream_files++] = optarg;
+      break;
+    /* Records instead of a stream of bytes. */
+    case 'g':
+      msg_enabled = true;
+      break;
+    /* Compress the data if the other host agrees. */
+    case 'k':
+      compress_enabled = true;
+      break;
     default:
       usage(progname);
       break;
@@ -1455,6 +3075,60 @@ int main(int argc , char *argv[]) {
   if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
     usage(progname);
   }
+  /* Broadcasting sends STDIN, not the output of programs. */
+  if (broadcast && (is_client || optind < argc))
+    usage(progname);
+  /* Programs already have output of their own. Files need a name for each
+     client. */
+  if (sink_pattern != NULL &&
+      (is_client || optind < argc ||
+       (strncmp(sink_pattern, "unix:", 5) != 0 &&
+        (strncmp(sink_pattern, "file:", 5) != 0 ||
+         strstr(sink_pattern, "%u") == NULL))))
+    usage(progname);
+  /* Striped transfers are sent from STDIN and written to STDOUT. */
+  if ((stripe_count > 0 && !is_client) ||
+      (stripe_server && (is_client || optind < argc || broadcast ||
+                         sink_pattern != NULL)))
+    usage(progname);
+
+  /* Streams are named after the connection and the stream number, and take
+     the place of the input and output of the connection. */
+  if (num_stream_files > 0 && (!is_client || streams_pattern == NULL))
+    usage(progname);
+  if (streams_pattern != NULL &&
+      (!pattern_valid(streams_pattern, 2) || broadcast || stripe_count > 0 ||
+       stripe_server || use_fastopen))
+    usage(progname);
+  if (streams_pattern != NULL)
+    mux_init(streams_pattern);
+  /* Records are read from and written to the connection's own input and
+     output. */
+  if (msg_enabled && (streams_pattern != NULL || broadcast ||
+                      stripe_count > 0 || stripe_server))
+    usage(progname);
+  /* So is compressed data, and the SYN carries either a fast-open block or a
+     compression block. */
+  if (compress_enabled && (msg_enabled || streams_pattern != NULL ||
+                           broadcast || stripe_count > 0 || stripe_server ||
+                           use_fastopen))
+    usage(progname);
+
+  /* Split the input across a client for each connection, each on the next
+     port. Only the clients go on from here. */
+  char stripe_port[16];
+  if (stripe_count > 0) {
+    int index = stripe_start(stripe_count);
+    if (index < 0) {
+      fprintf(stderr, "[ERROR] Could not start striped transfer\n");
+      return 1;
+    }
+    port += index;
+    srand(seed + index);
+    snprintf(stripe_port, sizeof(stripe_port), "%d", port);
+    port_str = stripe_port;
+    striped = true;
+  }
 
   /* Construct log file if logging is turned on. Don't create a file if not
      logging data, since that is only used for testing purposes. */
@@ -1469,6 +3143,37 @@ int main(int argc , char *argv[]) {
     write_log_header(log_file);
   }
 
+  /* Input sent and not acknowledged yet is only freed once the other host
+     takes it, so it must not fill the hard limit by itself: received data
+     would then be dropped at both ends for good. Leave half of it for what
+     is received. */
+  mem_input_limit = mem_soft_limit;
+  if (mem_hard_limit > 0 &&
+      (mem_input_limit == 0 || mem_input_limit > mem_hard_limit / 2))
+    mem_input_limit = mem_hard_limit / 2;
+
+  /* Start tracing protocol events, profiling and hardware counters if asked
+     to. */
+  PROF_INIT();
+  if (trace_file != NULL && trace_init(trace_file) < 0)
+    return 1;
+  if (use_perf && perf_init() < 0)
+    fprintf(stderr, "[INFO] Continuing without hardware counters\n");
+  if (trace_file != NULL || perf_enabled || PROF_ENABLED) {
+    signal(SIGINT, exit_on_signal);
+    signal(SIGTERM, exit_on_signal);
+  }
+  if (stats_file != NULL && stats_init(stats_file, stats_interval) < 0)
+    return 1;
+  if (use_fastopen && fastopen_init(is_client ? fastopen_file : NULL) < 0)
+    return 1;
+  if (use_metrics)
+    metrics_init();
+  if (rate_file != NULL && ratelimit_init(rate_file) < 0)
+    return 1;
+  if (codel_target >= 0)
+    codel_init(codel_target, codel_interval);
+
   /* Global configuration. */
   struct config cc;
   config = &cc;
@@ -1480,10 +3185,16 @@ int main(int argc , char *argv[]) {
   cfg.send_window = window * MAX_SEG_DATA_SIZE;
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
+  cfg.keepalive = keepalive;
+  cfg.keepalive_interval = keepalive_interval;
+  cfg.keepalive_probes = keepalive_probes;
+  cfg.idle_timeout = idle_timeout;
+  cfg.initial_window = initial_window > 0 ? initial_window : 1;
+  wheel_init(cfg.timer);
 
   /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
+  struct pollfd _events[NUM_POLL + NUM_CONN_POLL];
+  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + NUM_CONN_POLL));
   events = _events;
 
   /* Start client/server. */
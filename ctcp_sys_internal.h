@@ -10,6 +10,9 @@
 #define CTCP_SYS_INTERNAL_H
 
 #include "ctcp.h"
+#include "ctcp_compress.h"
+#include "ctcp_msg.h"
+#include "ctcp_stripe.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
 
@@ -24,15 +27,19 @@
 /** Maximum number of clients that can connect to the server. */
 #define MAX_NUM_CLIENTS 10
 
+/** Maximum number of completed handshakes waiting for a connection slot. */
+#define ACCEPT_BACKLOG 16
+
 /** Default number of things to poll (stdin, stdout, socket). */
 #define NUM_POLL 3
 
+/** Number of things to poll for connections: the output of their programs,
+    and their own output sinks. */
+#define NUM_CONN_POLL (2 * MAX_NUM_CLIENTS)
+
 /** Polling interval in milliseconds. */
 #define POLL_INTERVAL 20
 
-/** Length of time to wait while sending resets in seconds. */
-#define RESET_THREAD_DURATION 1
-
 /* Parameters to be changed by the tester. */
 
 /** Retransmission interval in milliseconds. */
@@ -44,6 +51,24 @@
 /** Connection timeout interval in seconds. */
 #define CONN_TIMEOUT 10
 
+/** Maximum SYN retransmission interval in milliseconds. */
+#define SYN_MAX_RTO 3000
+
+/** How long a closed connection stays in TIME_WAIT, in milliseconds. */
+#define TIME_WAIT_INTERVAL 2000
+
+/** Number of closed connections that can be in TIME_WAIT at once. */
+#define TIME_WAIT_SIZE 64
+
+/** Default time between unanswered keepalive probes, in milliseconds. */
+#define KEEPALIVE_INTERVAL 1000
+
+/** Default number of unanswered keepalive probes before giving up. */
+#define KEEPALIVE_PROBES 5
+
+/** Default initial congestion window, in segments. */
+#define INITIAL_WINDOW 10
+
 /////////////////////////////////// SYSTEM ////////////////////////////////////
 
 /** Pipe created by parent process. */
@@ -64,6 +89,52 @@
 /** Maximum space for buffering STDOUT for a given connection. */
 #define MAX_BUF_SPACE 8192
 
+/**
+ * Bytes of input a connection may read, and of output it may drain, in one
+ * pass through the event loop (deficit round robin quantum).
+ */
+#define DRR_QUANTUM (4 * MAX_SEG_DATA_SIZE)
+
+/**
+ * Priority classes, highest first. Control segments (ACKs, window updates,
+ * FINs) and resent data go ahead of all new data, which goes by the class of
+ * its connection. Connections are also served in this order by the event
+ * loop.
+ */
+typedef enum prio_class {
+  PRIO_CONTROL,
+  PRIO_INTERACTIVE,            /* Latency-sensitive connections */
+  PRIO_NORMAL,
+  PRIO_BULK,                   /* Large transfers */
+  PRIO_NUM_CLASSES
+} prio_class_t;
+
+/** Reasons for not reading input for a connection, any number at once. */
+typedef enum throttle_reason {
+  THROTTLE_CONNECT = 1 << 0,   /* Waiting for the handshake */
+  THROTTLE_MEMORY = 1 << 1,    /* Above the soft memory limit */
+  THROTTLE_QUEUE = 1 << 2      /* Input waits too long to be sent */
+} throttle_reason_t;
+
+/**
+ * Most segments waiting for room in the socket in each class. Segments past
+ * that are dropped, like segments lost in the network.
+ */
+#define SEND_QUEUE_MAX 256
+
+/** A segment waiting for room in the socket. */
+struct queued_pkt {
+  struct queued_pkt *next;
+  union {
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+  } addr;                   /* Destination */
+  socklen_t addr_len;       /* Length of the destination */
+  size_t len;               /* Length of the packet */
+  char buf[];               /* Packet */
+};
+typedef struct queued_pkt queued_pkt_t;
+
 /**
  * Chunk of output. Used to do asynchronous output. A connection will store
  * a queue of chunks to be outputted later.
@@ -76,6 +147,15 @@ struct chunk {
 } __attribute__((packed));
 typedef struct chunk chunk_t;
 
+/** Memory held by a connection, in bytes, by category. */
+struct mem_account {
+  size_t used[MEM_NUM_CATEGORIES];  /* Currently held */
+  size_t high[MEM_NUM_CATEGORIES];  /* High-water marks */
+  size_t total;                     /* Currently held, all categories */
+  size_t total_high;                /* High-water mark of the total */
+};
+typedef struct mem_account mem_account_t;
+
 
 /**
  * Makes a file descriptor asynchronous.
@@ -126,10 +206,46 @@ long need_timer_in(const struct timespec *last, long interval) {
 }
 
 /**
- * Send resets to previous connections, if they exist. We can tell if there are
- * lots of RSTs or ACKs being sent to us.
+ * Sends a reset in response to a packet from a previous session.
+ *
+ * pkt: The IP packet received.
+ * returns: -1 if the reset could not be sent, 0 otherwise.
+ */
+int send_reset(char *pkt);
+
+/**
+ * Sends an ACK with the connection's current sequence and ack numbers.
+ *
+ * dst: A conn_t object associated with the destination.
+ * returns: -1 if error, 0 otherwise.
+ */
+int send_ack(conn_t *dst);
+
+/**
+ * Fills in the address to send a connection's packets to.
+ *
+ * dst: Destination connection object.
+ * pkt: The packet to fill in the address of.
+ * returns: Length of the address.
+ */
+socklen_t conn_dest(conn_t *dst, queued_pkt_t *pkt);
+
+/**
+ * Sends a packet, or queues it behind waiting packets of its class or a
+ * higher one.
+ *
+ * dst: Destination connection object.
+ * prio: Class of the packet.
+ * buf: Packet to send.
+ * len: Length of the packet.
+ * returns: len if the packet was sent or queued, -1 if it was dropped.
+ */
+int send_prio(conn_t *dst, prio_class_t prio, const void *buf, size_t len);
+
+/**
+ * Sends queued packets, highest class first, until the socket is full.
  */
-void *send_resets(void *args);
+void send_queue_flush();
 
 
 /////////////////////////////////// SEGMENTS //////////////////////////////////
@@ -265,12 +381,30 @@ int rand_percent(int level) {
 /** Ethernet interface prefix to determine the client's own IP address. */
 #define ETH_INTERFACE "eth"
 
-/** Connection details for a host connected to the current host. */
+/**
+ * Connection setup state. Only kept while the client is connecting, or until
+ * the data it sent with the SYN is handed on.
+ */
+struct handshake {
+  long connect_start;          /* When the first SYN was sent, in ms */
+  long syn_sent;               /* When the last SYN was sent, in ms */
+  int syn_rto;                 /* SYN retransmission timeout, in ms */
+  int syn_retries;             /* Number of times the SYN was resent */
+  char *syn_data;              /* Data sent with the SYN, not yet handed on */
+};
+typedef struct handshake handshake_t;
+
+/**
+ * Connection details for a host connected to the current host. Fields used
+ * for every segment come first; state only needed while connecting or while
+ * memory is accounted for is allocated separately, so an idle connection
+ * stays small. The Unix socket address is not stored, it follows from the
+ * port (see conn_sunaddr).
+ */
 struct conn {
+  uint32_t id;                 /* Unique connection number */
   in_addr_t ip_addr;           /* IP address */
   int port;                    /* Port */
-  struct sockaddr_in saddr;    /* Socket address */
-  struct sockaddr_un sunaddr;  /* Unix socket */
   ctcp_state_t *state;         /* Connection state */
 
   uint32_t init_seqno;         /* My initial sequence number */
@@ -279,24 +413,85 @@ struct conn {
   uint32_t seqno;              /* Current sequence number */
   uint32_t next_seqno;         /* Sequence number of next segment to send */
   uint32_t ackno;              /* Current ack number */
+  uint32_t last_seqno;         /* Sequence number of the last segment sent */
+  uint32_t last_ackno;         /* Ack number of the last segment sent */
 
-  int stdin;                   /* STDIN for the program */
-  int stdout;                  /* STDOUT for the program */
-  struct pollfd *poll_fd;      /* Used for polling for output from program */
-
+  bool connecting;             /* Waiting for the SYN-ACK */
+  bool fastopen;               /* Client asked for a fast-open cookie */
+  bool compressed;             /* Compression was agreed on */
   bool read_eof;               /* EOF read from STDIN */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
+  bool reset;                  /* Output could not be parsed, the
+                                  connection was reset */
   bool delete_me;              /* Whether or not to delete this object. */
-
+  uint8_t input_throttled;     /* Reasons for not reading input, 0 if
+                                  reading */
+  uint16_t syn_data_len;       /* Length of the data sent with the SYN */
+  int deficit;                 /* Bytes it may still read and drain in this
+                                  pass through the event loop */
+  prio_class_t prio;           /* Class of its data */
+  uint32_t sent_seqno;         /* End of the newest data sent, data below
+                                  this is being resent */
+
+  shared_buf_t *broadcast;     /* Broadcast input not taken yet, NULL if
+                                  none */
   chunk_t *out_queue;          /* Queue for output to STDOUT */
   chunk_t **out_queue_tail;    /* End of the output queue */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
+
+  struct sockaddr_in saddr;    /* Socket address */
+  long handshake_rtt;          /* SYN to SYN-ACK time in us, 0 if unknown */
+  handshake_t *hs;             /* Connection setup, NULL once done */
+  mem_account_t *mem;          /* Memory held by this connection, NULL if
+                                  not accounted for */
+
+  int stdin;                   /* STDIN for the program */
+  int stdout;                  /* STDOUT for the program */
+  struct pollfd *poll_fd;      /* Used for polling for output from program */
+  int out_fd;                  /* Where output goes: STDOUT, the program or
+                                  its own sink */
+  struct pollfd *out_poll;     /* Used for polling for room in out_fd */
+  stripe_member_t *stripe;     /* Part in a striped transfer, NULL if not
+                                  striped */
+  mux_t *mux;                  /* Streams multiplexed in it, NULL if not
+                                  multiplexed */
+  msg_t *msg;                  /* Records sent and received, NULL if not in
+                                  message mode */
+  compress_t *compress;        /* Compression of the data, NULL if not
+                                  compressed */
 };
 typedef struct conn conn_t;
 
+/**
+ * A recently closed connection. Segments still arriving for it (e.g. a FIN
+ * retransmitted because our last ACK was lost) are absorbed instead of being
+ * taken as leftovers from an unknown session.
+ */
+struct time_wait {
+  in_addr_t ip_addr;           /* IP address of the other host */
+  int port;                    /* Port of the other host */
+  uint32_t their_init_seqno;   /* Their initial sequence number */
+  uint32_t seqno;              /* Sequence number of the last segment sent */
+  uint32_t ackno;              /* Ack number of the last segment sent */
+  long expires;                /* When the entry can be reused, in ms */
+};
+typedef struct time_wait time_wait_t;
+
+/** A handshake completed with a SYN cookie, waiting for a connection slot. */
+struct pending_conn {
+  in_addr_t ip_addr;           /* IP address of the client */
+  int port;                    /* Port of the client */
+  uint32_t their_init_seqno;   /* Their initial sequence number */
+  uint32_t init_seqno;         /* My initial sequence number (the cookie) */
+  uint16_t window;             /* Their receive window */
+  bool compressed;             /* Compression was agreed on */
+  long queued;                 /* When the handshake completed, in ms */
+};
+typedef struct pending_conn pending_conn_t;
+
 
 /**
  * Add to the conn_t list.
@@ -306,6 +501,44 @@ typedef struct conn conn_t;
  */
 void conn_add(conn_t *conn);
 
+/**
+ * [Server only]
+ * Handles a segment from a host we have no connection with, in case it
+ * completes a handshake answered with a SYN cookie.
+ *
+ * pkt: The IP packet received.
+ * rconn: Return parameter. The new connection, if the segment should be
+ *        passed on.
+ * returns: Whether or not the segment belongs to such a handshake.
+ */
+bool tcp_cookie_ack(char *pkt, conn_t **rconn);
+
+/**
+ * [Client only]
+ * Frees the connection setup state once the handshake is over and the data
+ * sent with the SYN has been handed on.
+ *
+ * conn: The connection to the server.
+ */
+void conn_handshake_done(conn_t *conn);
+
+/**
+ * [Server only]
+ * Executes a new program upon client connection.
+ *
+ * conn: The conn_t associated with the client.
+ */
+void execute_program(conn_t *conn);
+
+/**
+ * [Server only]
+ * Opens the output sink of a new connection (--sink). Output goes to STDOUT
+ * if it cannot be opened.
+ *
+ * conn: The conn_t associated with the client.
+ */
+void open_sink(conn_t *conn);
+
 /**
  * Set up a conn_t object with the right values.
  *
@@ -319,13 +552,8 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   conn->ip_addr = ip_addr;
   conn->port = port;
 
-  /* Socket address. Could be a Unix socket. */
-  if (unix_socket) {
-    memset(&conn->sunaddr, 0, sizeof(struct sockaddr_un));
-    conn->sunaddr.sun_family = AF_UNIX;
-    sprintf(conn->sunaddr.sun_path, "/%d", port);
-  }
-  else {
+  /* Socket address. A Unix socket address is made up when sending. */
+  if (!unix_socket) {
     conn->saddr.sin_family = AF_INET;
     conn->saddr.sin_addr.s_addr = ip_addr;
   }
@@ -339,6 +567,19 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   conn->ackno = 0;
 }
 
+/**
+ * Makes up the Unix socket address of a connection, which is named after its
+ * port.
+ *
+ * conn: The conn_t object.
+ * sunaddr: Return parameter. The address.
+ */
+void conn_sunaddr(conn_t *conn, struct sockaddr_un *sunaddr) {
+  memset(sunaddr, 0, sizeof(struct sockaddr_un));
+  sunaddr->sun_family = AF_UNIX;
+  sprintf(sunaddr->sun_path, "/%d", conn->port);
+}
+
 /**
  * Gets the client's own IP address.
  *
@@ -0,0 +1,153 @@
+#include <pthread.h>
+
+#include "ctcp_trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+/** Maximum number of threads that can own a ring. */
+#define TRACE_MAX_THREADS 16
+
+/** Ring of trace records owned by one thread. */
+typedef struct trace_ring {
+  uint64_t head;                          /* Total records ever written */
+  uint32_t thread;                        /* Index of the owning thread */
+  trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+bool trace_enabled = false;
+
+static char trace_filename[256];
+static pid_t trace_pid;
+
+static trace_ring_t *rings[TRACE_MAX_THREADS];
+static int num_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t *my_ring;
+static volatile sig_atomic_t dump_requested;
+
+static const char *event_names[TRACE_NUM_EVENTS] = {
+  "conn_init",
+  "conn_destroy",
+  "timeout",
+  "retransmit",
+  "window_blocked",
+  "dup_ack",
+  "fin_state",
+  "output_blocked",
+  "keepalive",
+  "idle_close",
+};
+
+/**
+ * Allocates the calling thread's ring and registers it for dumping. Returns
+ * NULL if too many threads are tracing.
+ */
+static trace_ring_t *trace_ring_create() {
+  trace_ring_t *ring = NULL;
+  pthread_mutex_lock(&rings_lock);
+  if (num_rings < TRACE_MAX_THREADS) {
+    ring = calloc(sizeof(trace_ring_t), 1);
+    ring->thread = num_rings;
+    rings[num_rings++] = ring;
+  }
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+static void trace_signal(int sig) {
+  dump_requested = 1;
+}
+
+int trace_init(const char *filename) {
+  int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "[ERROR] Could not open trace file %s\n", filename);
+    return -1;
+  }
+  close(fd);
+
+  snprintf(trace_filename, sizeof(trace_filename), "%s", filename);
+  trace_pid = getpid();
+  trace_enabled = true;
+
+  signal(SIGUSR1, trace_signal);
+  atexit(trace_dump);
+  return 0;
+}
+
+void trace_event(trace_event_t event, uint32_t conn_id, uint32_t a0,
+                 uint32_t a1, uint32_t a2, uint32_t a3) {
+  trace_ring_t *ring = my_ring;
+  if (ring == NULL) {
+    ring = my_ring = trace_ring_create();
+    if (ring == NULL)
+      return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  trace_record_t *rec = &ring->records[ring->head & TRACE_RING_MASK];
+  rec->timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec->conn_id = conn_id;
+  rec->event = event;
+  rec->args[0] = a0;
+  rec->args[1] = a1;
+  rec->args[2] = a2;
+  rec->args[3] = a3;
+  ring->head++;
+}
+
+void trace_poll() {
+  if (!dump_requested)
+    return;
+
+  dump_requested = 0;
+  trace_dump();
+}
+
+void trace_dump() {
+  /* Processes forked off to simulate unreliability must not overwrite the
+     parent's trace. */
+  if (!trace_enabled || getpid() != trace_pid)
+    return;
+
+  int fd = open(trace_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd < 0)
+    return;
+
+  trace_file_hdr_t hdr;
+  hdr.magic = TRACE_MAGIC;
+  hdr.version = TRACE_VERSION;
+  hdr.record_size = sizeof(trace_record_t);
+  hdr.num_rings = num_rings;
+  write(fd, &hdr, sizeof(hdr));
+
+  int i;
+  for (i = 0; i < hdr.num_rings; i++) {
+    trace_ring_t *ring = rings[i];
+    uint64_t head = ring->head;
+    uint64_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    uint64_t start = (head - count) & TRACE_RING_MASK;
+
+    trace_ring_hdr_t ring_hdr;
+    ring_hdr.thread = ring->thread;
+    ring_hdr.num_records = count;
+    write(fd, &ring_hdr, sizeof(ring_hdr));
+
+    /* Oldest records first. The ring may wrap around once. */
+    uint64_t first = TRACE_RING_SIZE - start;
+    if (first > count)
+      first = count;
+    write(fd, &ring->records[start], first * sizeof(trace_record_t));
+    if (count > first)
+      write(fd, &ring->records[0], (count - first) * sizeof(trace_record_t));
+  }
+  close(fd);
+}
+
+const char *trace_event_name(uint16_t event) {
+  if (event >= TRACE_NUM_EVENTS)
+    return "unknown";
+  return event_names[event];
+}
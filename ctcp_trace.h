@@ -0,0 +1,108 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Low-overhead binary tracing of cTCP protocol events (timeouts, window
+ * stalls, retransmissions, teardown state changes, etc.). Events are written
+ * into a per-thread ring buffer and dumped to a file on SIGUSR1 or at exit.
+ * Use ctcp_trace_decode to turn a dump into readable text.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+#include "ctcp_sys.h"
+
+/** Number of records kept per thread. Must be a power of two. */
+#define TRACE_RING_SIZE 65536
+
+/** Magic number and version at the start of a trace dump. */
+#define TRACE_MAGIC 0x43545243
+#define TRACE_VERSION 1
+
+/** Types of traced events. */
+typedef enum trace_event {
+  TRACE_CONN_INIT,          /* Connection created: send window, recv window */
+  TRACE_CONN_DESTROY,       /* Connection destroyed: seqno, ackno */
+  TRACE_TIMEOUT,            /* Timeout fired: timeout count, seqno,
+                               next seqno */
+  TRACE_RETRANSMIT,         /* Retransmission: seqno, bytes in flight,
+                               segments queued */
+  TRACE_WINDOW_BLOCKED,     /* Send window full: window used, window,
+                               next segment size */
+  TRACE_DUP_ACK,            /* Duplicate segment/ACK: seqno, ackno */
+  TRACE_FIN_STATE,          /* Teardown state change: old state, new state,
+                               seqno */
+  TRACE_OUTPUT_BLOCKED,     /* No room to output: space, bytes pending */
+  TRACE_KEEPALIVE,          /* Keepalive probe sent: probe count, idle
+                               time in ms */
+  TRACE_IDLE_CLOSE,         /* Idle connection closed: idle time in ms,
+                               unanswered probes */
+  TRACE_NUM_EVENTS
+} trace_event_t;
+
+/** A single trace record. Written to the dump file as-is. */
+typedef struct trace_record {
+  uint64_t timestamp;       /* Monotonic time, in nanoseconds */
+  uint32_t conn_id;         /* Connection the event belongs to */
+  uint16_t event;           /* Event type (trace_event_t) */
+  uint16_t reserved;
+  uint32_t args[4];         /* Event-specific arguments */
+} trace_record_t;
+
+/** Header at the start of a dump file. */
+typedef struct trace_file_hdr {
+  uint32_t magic;           /* TRACE_MAGIC */
+  uint16_t version;         /* TRACE_VERSION */
+  uint16_t record_size;     /* sizeof(trace_record_t) */
+  uint32_t num_rings;       /* Number of per-thread rings that follow */
+} trace_file_hdr_t;
+
+/** Header before the records of each per-thread ring in a dump file. */
+typedef struct trace_ring_hdr {
+  uint32_t thread;          /* Index of the thread that owned the ring */
+  uint32_t num_records;     /* Records that follow, oldest first */
+} trace_ring_hdr_t;
+
+/** Whether or not tracing is turned on. Checked before recording anything. */
+extern bool trace_enabled;
+
+/**
+ * Turns on tracing. Installs a SIGUSR1 handler and an exit handler that dump
+ * all rings into the given file, see trace_poll().
+ *
+ * filename: File to dump the trace into. Overwritten on each dump.
+ * returns: 0 on success, -1 if the file could not be opened.
+ */
+int trace_init(const char *filename);
+
+/**
+ * Records an event into the calling thread's ring. Use TRACE() instead of
+ * calling this directly so nothing is evaluated when tracing is off.
+ */
+void trace_event(trace_event_t event, uint32_t conn_id, uint32_t a0,
+                 uint32_t a1, uint32_t a2, uint32_t a3);
+
+/**
+ * Writes the contents of all rings to the trace file.
+ */
+void trace_dump();
+
+/**
+ * Writes the rings to the trace file if SIGUSR1 was received since the last
+ * call. Called from the event loop.
+ */
+void trace_poll();
+
+/**
+ * Returns the name of an event, for printing.
+ */
+const char *trace_event_name(uint16_t event);
+
+#define TRACE(event, conn_id, a0, a1, a2, a3)                   \
+  do {                                                          \
+    if (trace_enabled)                                          \
+      trace_event((event), (conn_id), (a0), (a1), (a2), (a3));  \
+  } while (0)
+
+#endif /* CTCP_TRACE_H */
@@ -0,0 +1,127 @@
+/******************************************************************************
+ * ctcp_trace_decode.c
+ * -------------------
+ * Decodes a binary trace dumped by cTCP (see ctcp_trace.h) into one line of
+ * text per event, ordered by time. Times are printed in microseconds relative
+ * to the first event.
+ *
+ * To compile, do the following:
+ *     make ctcp_trace_decode
+ *
+ * To run, do the following:
+ *     ./ctcp_trace_decode trace.bin
+ *
+ *****************************************************************************/
+
+#include "ctcp_trace.h"
+
+/** Names of the teardown states, as used in ctcp.c. */
+static const char *teardown_names[] = {
+  "NO_CLOSE", "ACTIVE_CLOSE", "PASSIVE_CLOSE", "CLOSING"
+};
+
+static const char *teardown_name(uint32_t state) {
+  if (state >= sizeof(teardown_names) / sizeof(teardown_names[0]))
+    return "?";
+  return teardown_names[state];
+}
+
+static int compare_records(const void *a, const void *b) {
+  const trace_record_t *ra = a, *rb = b;
+  if (ra->timestamp < rb->timestamp)
+    return -1;
+  return ra->timestamp > rb->timestamp;
+}
+
+/**
+ * Prints out the arguments of a record according to its event type.
+ */
+static void print_args(trace_record_t *rec) {
+  uint32_t *a = rec->args;
+  switch (rec->event) {
+  case TRACE_CONN_INIT:
+    printf("send_window=%u recv_window=%u", a[0], a[1]);
+    break;
+  case TRACE_CONN_DESTROY:
+    printf("seqno=%u ackno=%u", a[0], a[1]);
+    break;
+  case TRACE_TIMEOUT:
+    printf("count=%u seqno=%u next_seqno=%u", a[0], a[1], a[2]);
+    break;
+  case TRACE_RETRANSMIT:
+    printf("seqno=%u inflight=%u queued=%u", a[0], a[1], a[2]);
+    break;
+  case TRACE_WINDOW_BLOCKED:
+    printf("used=%u window=%u next=%u", a[0], a[1], a[2]);
+    break;
+  case TRACE_DUP_ACK:
+    printf("seqno=%u ackno=%u", a[0], a[1]);
+    break;
+  case TRACE_FIN_STATE:
+    printf("%s -> %s seqno=%u", teardown_name(a[0]), teardown_name(a[1]),
+           a[2]);
+    break;
+  case TRACE_OUTPUT_BLOCKED:
+    printf("space=%u pending=%u", a[0], a[1]);
+    break;
+  case TRACE_KEEPALIVE:
+    printf("probe=%u idle=%ums", a[0], a[1]);
+    break;
+  case TRACE_IDLE_CLOSE:
+    printf("idle=%ums probes=%u", a[0], a[1]);
+    break;
+  default:
+    printf("%u %u %u %u", a[0], a[1], a[2], a[3]);
+    break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s trace_file\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  trace_file_hdr_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+      hdr.version != TRACE_VERSION ||
+      hdr.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "[ERROR] %s is not a cTCP trace\n", argv[1]);
+    return 1;
+  }
+
+  /* Read in the records from all rings. */
+  trace_record_t *records = NULL;
+  size_t num_records = 0;
+  int i;
+  for (i = 0; i < hdr.num_rings; i++) {
+    trace_ring_hdr_t ring_hdr;
+    if (fread(&ring_hdr, sizeof(ring_hdr), 1, f) != 1)
+      break;
+    records = realloc(records, (num_records + ring_hdr.num_records) *
+                               sizeof(trace_record_t));
+    num_records += fread(records + num_records, sizeof(trace_record_t),
+                         ring_hdr.num_records, f);
+  }
+  fclose(f);
+
+  qsort(records, num_records, sizeof(trace_record_t), compare_records);
+
+  size_t j;
+  for (j = 0; j < num_records; j++) {
+    trace_record_t *rec = &records[j];
+    printf("%12.3f\tconn %u\t%-15s\t",
+           (rec->timestamp - records[0].timestamp) / 1000.0, rec->conn_id,
+           trace_event_name(rec->event));
+    print_args(rec);
+    printf("\n");
+  }
+  free(records);
+  return 0;
+}
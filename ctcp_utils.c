@@ -22,6 +22,27 @@ long current_time() {
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+long current_time_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int random_bytes(void *buf, size_t len) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0)
+    return -1;
+  int r = read(fd, buf, len);
+  close(fd);
+  return r == len ? 0 : -1;
+}
+
+uint64_t mix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
 void print_hdr_ctcp(ctcp_segment_t *segment) {
   fprintf(stderr, "[cTCP] seqno: %d, ackno: %d, len: %d, flags:",
           ntohl(segment->seqno), ntohl(segment->ackno), ntohs(segment->len));
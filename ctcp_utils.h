@@ -27,6 +27,31 @@ uint16_t cksum(const void *_data, uint16_t len);
  */
 long current_time();
 
+/**
+ * Gets the current time in microseconds. Use this for measuring round-trip
+ * times, which can be well under a millisecond on the same machine.
+ */
+long current_time_us();
+
+/**
+ * Fills a buffer with random bytes from /dev/urandom. Use this for secrets,
+ * which rand() is too predictable for.
+ *
+ * buf: Buffer to fill.
+ * len: Number of bytes.
+ * returns: 0 on success, -1 on failure.
+ */
+int random_bytes(void *buf, size_t len);
+
+/**
+ * Mixes the bits of a 64-bit value so that every input bit affects every
+ * output bit (the splitmix64 finalizer). Not cryptographic, but enough to
+ * derive cookies from a secret.
+ *
+ * x: The value to mix.
+ */
+uint64_t mix64(uint64_t x);
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,
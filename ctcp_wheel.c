@@ -0,0 +1,78 @@
+#include "ctcp_wheel.h"
+#include "ctcp_utils.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+static wheel_timer_t *slots[WHEEL_SLOTS];
+static int tick_len = 1;
+
+/** Last tick whose slot has been visited. */
+static long last_tick;
+
+void wheel_init(int tick) {
+  tick_len = tick > 0 ? tick : 1;
+  last_tick = current_time() / tick_len;
+}
+
+void wheel_timer_init(wheel_timer_t *timer, void (*fire)(void *), void *arg) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->fire = fire;
+  timer->arg = arg;
+}
+
+void wheel_schedule(wheel_timer_t *timer, long delay) {
+  wheel_cancel(timer);
+  timer->expires = current_time() + delay;
+
+  /* Round up so the timer does not fire early. A slot that has already been
+     visited is only visited again one turn later, so use the next one. */
+  long tick = (timer->expires + tick_len - 1) / tick_len;
+  if (tick <= last_tick)
+    tick = last_tick + 1;
+
+  wheel_timer_t **slot = &slots[tick & WHEEL_MASK];
+  timer->next = *slot;
+  if (*slot)
+    (*slot)->prev = &timer->next;
+  timer->prev = slot;
+  *slot = timer;
+}
+
+void wheel_cancel(wheel_timer_t *timer) {
+  if (timer->prev == NULL)
+    return;
+
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  *timer->prev = timer->next;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+void wheel_advance(long now) {
+  long tick = now / tick_len;
+
+  /* One turn visits every slot. */
+  if (tick - last_tick > WHEEL_SLOTS)
+    last_tick = tick - WHEEL_SLOTS;
+
+  while (last_tick < tick) {
+    last_tick++;
+    wheel_timer_t **slot = &slots[last_tick & WHEEL_MASK];
+
+    /* Fire one timer at a time and start over, since firing may cancel or
+       schedule other timers in the same slot. */
+    wheel_timer_t *timer = *slot;
+    while (timer != NULL) {
+      if (timer->expires > now) {
+        timer = timer->next;
+        continue;
+      }
+      wheel_cancel(timer);
+      timer->fire(timer->arg);
+      timer = *slot;
+    }
+  }
+}
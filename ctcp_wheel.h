@@ -0,0 +1,72 @@
+/******************************************************************************
+ * ctcp_wheel.h
+ * ------------
+ * Hashed timer wheel for timers that are far apart and rarely fire, such as
+ * keepalive and idle timeouts. Timers hang off the slot of the tick they
+ * expire in, so scheduling and cancelling take constant time and a timer
+ * costs nothing until the wheel reaches its slot. Timers more than one turn
+ * of the wheel away are skipped until their turn comes.
+ *
+ * The wheel is driven from ctcp_timer(), so timers fire up to one timer
+ * interval late, but never early.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_WHEEL_H
+#define CTCP_WHEEL_H
+
+#include "ctcp_sys.h"
+
+/** Number of slots in the wheel. Must be a power of two. */
+#define WHEEL_SLOTS 256
+
+/** A timer. Embed it in the object it belongs to. */
+typedef struct wheel_timer {
+  struct wheel_timer *next;   /* Next in the slot */
+  struct wheel_timer **prev;  /* Prev in the slot, NULL if not scheduled */
+  long expires;               /* Time to fire at, in milliseconds */
+  void (*fire)(void *arg);    /* Called when the timer expires */
+  void *arg;                  /* Argument for fire */
+} wheel_timer_t;
+
+/**
+ * Sets up the wheel.
+ *
+ * tick: Length of a slot, in milliseconds. Should be the interval at which
+ *       wheel_advance() is called.
+ */
+void wheel_init(int tick);
+
+/**
+ * Sets up a timer. It is not scheduled yet.
+ *
+ * timer: The timer.
+ * fire: Function called when the timer expires. It may schedule the timer
+ *       again or free the object the timer is embedded in.
+ * arg: Argument for fire.
+ */
+void wheel_timer_init(wheel_timer_t *timer, void (*fire)(void *), void *arg);
+
+/**
+ * Schedules a timer, moving it if it was already scheduled.
+ *
+ * timer: The timer.
+ * delay: Time from now until it expires, in milliseconds.
+ */
+void wheel_schedule(wheel_timer_t *timer, long delay);
+
+/**
+ * Cancels a timer. Does nothing if it is not scheduled.
+ *
+ * timer: The timer.
+ */
+void wheel_cancel(wheel_timer_t *timer);
+
+/**
+ * Fires all timers that have expired since the last call.
+ *
+ * now: The current time, in milliseconds.
+ */
+void wheel_advance(long now);
+
+#endif /* CTCP_WHEEL_H */